@@ -31,6 +31,96 @@
 #include <float.h>
 #include <iostream>
 #include <utility>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <ratio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <queue>
+#include <stdint.h>
+
+#include "Cover_Tree_Parallel.h"
+#include "Cover_Tree_Serial.h"
+#include "Cover_Tree_Stats.h"
+
+/**
+ * HasBoundedDistance<Point>::value is true iff Point has a member
+ * double distance(const Point& p, double bound) const.
+ */
+template<class Point>
+class HasBoundedDistance
+{
+    template<class P>
+    static auto test(int) -> decltype(std::declval<const P&>().distance
+                                      (std::declval<const P&>(), 0.0),
+                                      std::true_type());
+    template<class P>
+    static std::false_type test(...);
+public:
+    static const bool value = decltype(test<Point>(0))::value;
+};
+
+template<class Base> class MappedCoverTree;
+
+/**
+ * Where a cover tree keeps its Stats: the total of every operation not
+ * made through a QueryContext, the lock guarding it, and the record of
+ * the insert or remove under way.
+ */
+template<class Stats, bool Enabled = Stats::enabled>
+class StatsRecorder
+{
+    mutable Stats _stats;
+    mutable std::mutex _statsLock;
+protected:
+    typename Stats::Operation _operation;//the insert or remove under way
+
+    /**
+     * Adds op, or every operation of stats, to the total.
+     */
+    void record(const typename Stats::Operation& op) const
+    {
+        std::lock_guard<std::mutex> guard(_statsLock);
+        _stats.add(op);
+    }
+    void record(const Stats& stats) const
+    {
+        std::lock_guard<std::mutex> guard(_statsLock);
+        _stats.merge(stats);
+    }
+    Stats recorded() const
+    {
+        std::lock_guard<std::mutex> guard(_statsLock);
+        return _stats;
+    }
+    void clearRecorded()
+    {
+        std::lock_guard<std::mutex> guard(_statsLock);
+        _stats = Stats();
+    }
+};
+
+/**
+ * A Stats which isn't enabled measures nothing, so there is no total and
+ * no lock, and every tree shares one empty record, which is never read.
+ */
+template<class Stats>
+class StatsRecorder<Stats, false>
+{
+protected:
+    static typename Stats::Operation _operation;
+
+    void record(const typename Stats::Operation&) const {}
+    void record(const Stats&) const {}
+    Stats recorded() const { return Stats(); }
+    void clearRecorded() {}
+};
+
+template<class Stats>
+typename Stats::Operation StatsRecorder<Stats, false>::_operation;
 
 /**
  * Cover Tree. Allows for insertion, removal, and k-nearest-neighbor
@@ -43,23 +133,82 @@
  * For example, a point could consist of a vector and a string
  * name, where their distance measure is simply euclidean distance but to be
  * equal they must have the same name in addition to having distance 0.
+ *
+ * Point may also define double Point::distance(const Point& p, double bound),
+ * which must return the exact distance whenever it is <= bound but may return
+ * any value greater than bound otherwise. If it exists, the tree passes the
+ * largest distance it still cares about as the bound so the point can stop
+ * computing early.
+ *
+ * Base is the std::ratio by which the scale grows from one level to the
+ * next. It must be more than 1 and at most 2; 2 is the base of the cover
+ * tree papers, while langford/cover_tree.cc uses 1.3 (std::ratio<13,10>),
+ * which makes more, tighter levels.
+ *
+ * Stats is told what each query, insert and remove does: its distance
+ * evaluations, the size of its cover set at each level, and the nodes it
+ * touched and pruned (see Cover_Tree_Stats.h). The default, NoStats,
+ * measures nothing and costs nothing; OperationStats keeps histograms of
+ * it all, which operationStats() returns.
  */
-template<class Point>
-class CoverTree
+template<class Point, class Base = std::ratio<2>, class Stats = NoStats>
+class CoverTree : private StatsRecorder<Stats>
 {
+    using StatsRecorder<Stats>::_operation;
+    using StatsRecorder<Stats>::record;
+
+    //writes trees out in its own layout (see Cover_Tree_Mapped.h)
+    template<class B> friend class MappedCoverTree;
+
     /**
      * Cover tree node. Consists of arbitrarily many points P, as long as
      * they have distance 0 to each other. Keeps track of its children.
      */
+    class CoverTreeNode;
+
+    /**
+     * A non-owning view of a contiguous run of a node's children. It stays
+     * valid until children are next added to or removed from that node.
+     */
+    class ChildRange
+    {
+    public:
+        typedef CoverTreeNode* const* const_iterator;
+    private:
+        const_iterator _begin;
+        const_iterator _end;
+    public:
+        ChildRange(const_iterator begin, const_iterator end)
+            : _begin(begin), _end(end) {}
+        const_iterator begin() const { return _begin; }
+        const_iterator end() const { return _end; }
+        unsigned int size() const { return _end-_begin; }
+        bool empty() const { return _begin==_end; }
+        CoverTreeNode* operator[](unsigned int i) const { return _begin[i]; }
+        CoverTreeNode* back() const { return *(_end-1); }
+    }; // ChildRange class
+
     class CoverTreeNode
     {
     private:
-        //_childMap[i] is a vector of the node's children at level i
-        std::map<int,std::vector<CoverTreeNode*> > _childMap;
+        //_children holds the node's children grouped by level, highest
+        //level first, so the children at any one level form a contiguous
+        //range. _childLevels[i] is the level at which _children[i] was added.
+        std::vector<CoverTreeNode*> _children;
+        std::vector<int> _childLevels;
         //_points is all of the points with distance 0 which are not equal.
         std::vector<Point> _points;
+        //_id is the node's slot in the NodeArena that owns it.
+        unsigned int _id;
+        //the node whose child this is (NULL for the root), and the
+        //distance to it, like parent_dist in langford/cover_tree.cc
+        CoverTreeNode* _parent;
+        double _parentDist;
+        //an upper bound on the distance to any descendant, like max_dist:
+        //at least _parentDist+_radius of every child
+        double _radius;
     public:
-        CoverTreeNode(const Point& p);
+        CoverTreeNode(const Point& p, unsigned int id);
         /**
          * Returns the children of the node at level i. Note that this means
          * the children exist in cover set i-1, not level i.
@@ -67,42 +216,323 @@ class CoverTree
          * Does not include the node itself, though technically every node
          * has itself as a child in a cover tree.
          */
+        ChildRange children(int level) const;
+        /**
+         * Same as children(level), but returns a copy which stays valid
+         * while the node is modified.
+         */
         std::vector<CoverTreeNode*> getChildren(int level) const;
-        void addChild(int level, CoverTreeNode* p);
+        /**
+         * Makes p a child at level, dist away from this node. The radius
+         * of this node is left for the tree to raise (see grow). Keeping
+         * the children grouped by level makes this, like removeChild, take
+         * time linear in the number of children.
+         */
+        void addChild(int level, CoverTreeNode* p, double dist);
         void removeChild(int level, CoverTreeNode* p);
         void addPoint(const Point& p);
         void removePoint(const Point& p);
-        const std::vector<Point>& getPoints() { return _points; }
+        const std::vector<Point>& getPoints() const { return _points; }
         double distance(const CoverTreeNode& p) const;
+        double distance(const Point& p) const;
         
         bool isSingle() const;
         bool hasPoint(const Point& p) const;
             
         const Point& getPoint() const;
+
+        unsigned int getId() const { return _id; }
+
+        CoverTreeNode* getParent() const { return _parent; }
+        double parentDistance() const { return _parentDist; }
+        double radius() const { return _radius; }
+        void setRadius(double r) { _radius = r; }
+
+        /**
+         * The level at which allChildren()[i] is a child of the node.
+         */
+        int childLevel(unsigned int i) const { return _childLevels[i]; }
+
+        /**
+         * Drops the node's points and children, keeping the memory of its
+         * vectors, so a slot on the free list holds no Point alive.
+         */
+        void release();
+
+        /**
+         * Releases the node and makes it hold only p, so the arena can hand
+         * a released slot out again without reallocating.
+         */
+        void reset(const Point& p);
         
         /**
-         * Return every child of the node from any level. This is handy for
-         * the destructor.
+         * Return every child of the node from any level.
          */
+        ChildRange allChildren() const;
         std::vector<CoverTreeNode*> getAllChildren() const;
+
+        /**
+         * Bytes held by the node and its vectors, not counting anything
+         * its points allocate themselves.
+         */
+        std::size_t memoryUsage() const;
     }; // CoverTreeNode class
+
+    /**
+     * Owns every node of a cover tree. Nodes are constructed in place in
+     * fixed-size blocks which never move, so a node can be addressed either
+     * by pointer or by its index, and the nodes themselves (though not the
+     * vectors of children and points each one owns) sit side by side
+     * rather than scattered across the heap. Removed nodes give up their
+     * points and go on a free list, to be reused by later inserts;
+     * destroying the arena walks the blocks linearly rather than the tree.
+     */
+    class NodeArena
+    {
+    private:
+        static const unsigned int BLOCK_SIZE = 1024;
+        std::vector<CoverTreeNode*> _blocks;
+        //_size is the number of slots ever constructed, live or free.
+        unsigned int _size;
+        std::vector<CoverTreeNode*> _free;
+
+        NodeArena(const NodeArena&) = delete;
+        NodeArena& operator=(const NodeArena&) = delete;
+    public:
+        NodeArena();
+        ~NodeArena();
+        CoverTreeNode* create(const Point& p);
+        /**
+         * Returns n to the free list. n must not be reachable from the tree
+         * anymore.
+         */
+        void destroy(CoverTreeNode* n);
+        CoverTreeNode* at(unsigned int id) const;
+        /**
+         * Puts every slot on the free list. The nodes keep their memory,
+         * which later creates reuse; ids are handed out from 0 again.
+         */
+        void clear();
+        /**
+         * Number of slots in use or on the free list; valid ids are below it.
+         */
+        unsigned int size() const { return _size; }
+    }; // NodeArena class
  private:
     typedef std::pair<double, CoverTreeNode*> distNodePair;
 
+    NodeArena _arena;
     CoverTreeNode* _root;
     unsigned int _numNodes;
-    int _maxLevel;//base^_maxLevel should be the max distance
-                  //between any 2 points
+    int _maxLevel;//the highest level at which the root has children;
+                  //the root alone is in every cover set above it
     int _minLevel;//A level beneath which there are no more new nodes.
 
+ public:
+    /**
+     * The shape of a tree, as reported by statistics(). The level of a
+     * node is the highest cover set it is in without its parent: _maxLevel
+     * for the root, and level-1 for a child at level. Histograms are
+     * indexed by the value counted, so fanOut[3] is the number of nodes
+     * with 3 children.
+     */
+    struct Statistics
+    {
+        int maxLevel;
+        int minLevel;
+        unsigned int nodes;
+        unsigned int points;
+        //levelNodes[i] is the number of nodes whose level is maxLevel-i,
+        //and levelParents[i] the number which have children at that level.
+        std::vector<unsigned int> levelNodes;
+        std::vector<unsigned int> levelParents;
+        std::vector<unsigned int> fanOut;//children of each node
+        std::vector<unsigned int> depths;//edges from the root to each node
+        std::vector<unsigned int> heights;//edges down to each node's deepest leaf
+        std::vector<unsigned int> pointsPerNode;
+        //bytes held by the nodes (see CoverTreeNode::memoryUsage), together
+        //with the arena slots on the free list
+        std::size_t bytes;
+    };
+
+    /**
+     * Working memory for k-nearest-neighbor queries, like the
+     * spare_cover_sets of langford/cover_tree.cc. Its buffers only ever
+     * grow, so once a context has served a few queries, further queries
+     * through it allocate nothing. A context must not be used by two
+     * threads at once.
+     */
+    class QueryContext
+    {
+        friend class CoverTree;
+        std::vector<distNodePair> cover;//the cover set Q_i of the query
+        //the k nearest nodes so far as a max-heap on distance, so the
+        //farthest one can be replaced in O(log k); sorted once done
+        std::vector<distNodePair> nearest;
+        std::vector<const Point*> points;//the answer to the last query
+        typename Stats::Operation operation;//what the last query did
+    public:
+        /**
+         * Every query made through this context is added here rather than
+         * to the tree's operationStats(), so threads with contexts of
+         * their own never contend for it. Merge it into a total as often
+         * as suits.
+         */
+        Stats stats;
+    };
+ private:
     std::vector<CoverTreeNode*>
         kNearestNodes(const Point& p, const unsigned int& k) const;
+
+    /**
+     * Leaves the k nearest nodes to p in context.nearest, nearest first,
+     * or k nodes (1+epsilon)-approximately nearest if epsilon > 0 (see
+     * kNearestNeighbors).
+     */
+    void kNearestNodes(const Point& p, const unsigned int& k,
+                       QueryContext& context, double epsilon = 0.0) const;
+
+    /**
+     * Appends the k nearest points to p, found with context, to kNN.
+     */
+    void kNearestNeighbors(const Point& p, const unsigned int& k,
+                           QueryContext& context, std::vector<Point>& kNN,
+                           double epsilon) const;
+
     /**
-     * Recursive implementation of the insert algorithm (see paper).
+     * Upper bound on the distance from a node to any of its descendants
+     * reached through children at levels <= level, or 0 if there are no
+     * such children anywhere in the tree.
      */
-    bool insert_rec(const Point& p,
-                    const std::vector<distNodePair>& Qi,
-                    const int& level);
+    double coverRadius(int level) const;
+
+    /**
+     * The levels whose scale is kept in the table behind scale().
+     */
+    static const int SCALE_LEVELS = 1100;
+
+    /**
+     * base^level. Looked up in a table built once per Base instead of
+     * calling pow in every level of every operation.
+     */
+    static double scale(int level);
+
+    /**
+     * The sum of base^i for every i <= level: an upper bound on the
+     * distance from a node to anything reached through its children at
+     * levels <= level. With base 2 this is base^(level+1).
+     */
+    static double reach(int level) { return scale(level+1)/(base-1); }
+
+    /**
+     * Returns the kth smallest distance in Q (DBL_MAX if Q has fewer than k
+     * nodes). scratch is overwritten.
+     */
+    static double kthDistance(const std::vector<distNodePair>& Q,
+                              const unsigned int& k,
+                              std::vector<double>& scratch);
+
+    /**
+     * Removes every pair in Q whose distance is greater than bound, and
+     * returns how many there were.
+     */
+    static std::size_t prune(std::vector<distNodePair>& Q, double bound);
+
+    /**
+     * Same as prune(Q, bound+radius), except that a node whose own radius
+     * is less than radius only keeps its pair within bound of that. Any
+     * pair it removes is of a node with nothing within bound of the query
+     * left below it.
+     */
+    static std::size_t prune(std::vector<distNodePair>& Q, double bound,
+                             double radius);
+
+    /**
+     * A radius is a sum of rounded distances, which can come out a hair
+     * under the distance it bounds, so every radius is kept this much
+     * (relatively) over the sum.
+     */
+    static constexpr double RADIUS_SLACK = 1e-9;
+
+    /**
+     * Raises the radius of n to r if it is less, then the radii of its
+     * ancestors in turn as far as that breaks their bound on it.
+     */
+    static void grow(CoverTreeNode* n, double r);
+
+    /**
+     * Sets the radius of every node from those of its children, bottom
+     * up. For trees built other than one node at a time.
+     */
+    void computeRadii();
+
+    /**
+     * Lowers _maxLevel to the highest level at which the root has
+     * children, so queries start at the first cover set holding more than
+     * the root. Leaves it alone if the root has no children.
+     */
+    void fitRoot();
+
+    /**
+     * Dual-tree k-nearest-neighbor search (see batch_nearest_neighbor in
+     * langford/cover_tree.cc). coverSet holds every node of this tree, with
+     * its distance to query, whose subtree below level may still contain
+     * one of the k nearest neighbors of a point in query's subtree below
+     * queryLevel. Each step lowers whichever of the two levels is larger,
+     * so that nearby queries share the work of descending this tree.
+     * coverSet is consumed.
+     */
+    void batch_nearest_rec(CoverTreeNode* query, int queryLevel,
+                           const CoverTree<Point,Base,Stats>& queries,
+                           std::vector<distNodePair>& coverSet, int level,
+                           const unsigned int& k,
+                           std::vector<std::pair<Point, std::vector<Point> > >&
+                           results,
+                           std::vector<double>& scratch) const;
+    /**
+     * The cover sets Q_i of one insert or remove, indexed by level i and
+     * stored contiguously. They are kept by the tree and cleared rather
+     * than freed between operations, so updates stop allocating once the
+     * buffers have grown. References into it stay valid until a level
+     * outside the range used so far is asked for.
+     */
+    class LevelSets
+    {
+    private:
+        std::vector<std::vector<distNodePair> > _sets;
+        int _top;//the level of _sets[0]
+        unsigned int _used;//_sets[i] is empty for every i >= _used
+    public:
+        LevelSets() : _top(0), _used(0) {}
+        /**
+         * Empties every level and makes room for levels bottom..top.
+         */
+        void reset(int top, int bottom);
+        std::vector<distNodePair>& operator[](int level);
+    }; // LevelSets class
+
+    /**
+     * What insert_iter and remove_iter remember about each level on the
+     * way down, for use on the way back up.
+     */
+    struct LevelStep
+    {
+        CoverTreeNode* node;//nearest node of Q_i to the point
+        double dist;//its distance to the point
+        CoverTreeNode* parent;//remove only: node's parent if dist is 0
+    };
+
+    LevelSets _levelSets;
+    std::vector<LevelStep> _steps;//_steps[i] is for level _maxLevel-i
+
+    /**
+     * The insert algorithm (see paper), with the recursion over levels
+     * replaced by a descent which records each level in _levelSets and
+     * _steps, followed by a climb back up to the lowest level at which p
+     * has a parent. If it meets a node with distance 0 to p on the way
+     * down, p is added to that node instead.
+     */
+    void insert_iter(const Point& p);
     
     /**
      * Finds the node in Q with the minimum distance to p. Returns a
@@ -111,28 +541,224 @@ class CoverTree
     distNodePair distance(const Point& p,
                           const std::vector<CoverTreeNode*>& Q);
 
-    
-    void remove_rec(const Point& p,
-                    std::map<int,std::vector<distNodePair> >& coverSets,
-                    int level,
-                    bool& multi);
+    /**
+     * p.distance(q, bound) if Point has a bounded distance function,
+     * otherwise p.distance(q). Either way the result is exact if it is
+     * <= bound.
+     */
+    static double distance(const Point& p, const Point& q, double bound)
+    {
+        return distance(p, q, bound,
+                        std::integral_constant
+                        <bool, HasBoundedDistance<Point>::value>());
+    }
+    static double distance(const Point& p, const Point& q, double bound,
+                           std::true_type)
+    {
+        return p.distance(q, bound);
+    }
+    static double distance(const Point& p, const Point& q, double,
+                           std::false_type)
+    {
+        return p.distance(q);
+    }
+
+
+    /**
+     * Removes p from the tree below the nodes already in
+     * _levelSets[_maxLevel], the same way as insert_iter: one pass down
+     * to _minLevel, then one back up which detaches the node and
+     * reparents its children.
+     */
+    void remove_iter(const Point& p);
+
+    typedef std::pair<double, unsigned int> distIndexPair;
+
+    /**
+     * The shared descent of removeBatch. cands holds (distance to n, index)
+     * for each point of victims that may be in n's subtree. Appends every
+     * node of the subtree which holds one of them to found, together with
+     * the index of the point. scratch[depth] and below are overwritten.
+     */
+    void locate(CoverTreeNode* n, const std::vector<Point>& victims,
+                const std::vector<distIndexPair>& cands,
+                std::vector<std::pair<CoverTreeNode*, unsigned int> >& found,
+                std::vector<std::vector<distIndexPair> >& scratch,
+                unsigned int depth);
+
+    /**
+     * Puts n, which is in none of the tree's cover sets, back into the
+     * tree together with its subtree, as a child at the lowest level no
+     * lower than lowest at which it is covered. Every child of n must be
+     * at a level below lowest, and n must be farther than base^(lowest-1)
+     * from every node of cover set lowest-1, as it is when it was in that
+     * cover set before (see removeBatch). Descends as insert_iter does,
+     * but only as far as cover set lowest-1.
+     */
+    void reattach(CoverTreeNode* n, int lowest);
+
+    /**
+     * Working state of a batch construction. dists[i] is a stack of the
+     * distances from points[i] to each node whose subtree it is currently
+     * being placed in, innermost node last. spare recycles point sets
+     * between calls, like the stack of v_arrays in langford/cover_tree.cc.
+     * pool is NULL unless the construction is parallel; lock guards spare
+     * and the tree's arena and counters, which every task shares.
+     */
+    struct BatchState
+    {
+        const std::vector<Point>& points;
+        std::vector<std::vector<double> > dists;
+        std::vector<std::vector<unsigned int> > spare;
+        TaskPool* pool;
+        std::mutex lock;
+        BatchState(const std::vector<Point>& p, TaskPool* t)
+            : points(p), dists(p.size()), pool(t) {}
+        std::vector<unsigned int> take();
+        void give(std::vector<unsigned int>& set);
+    };
+
+    /**
+     * A child made by batch_insert whose subtree is being built by a task
+     * of the pool. set holds the points handed to it, and afterwards the
+     * ones it didn't consume.
+     */
+    struct BatchChild
+    {
+        CoverTreeNode* node;
+        std::vector<unsigned int> set;
+        std::atomic<bool> done;
+        BatchChild(CoverTreeNode* n) : node(n), done(false) {}
+    };
+
+    /**
+     * Subtrees of fewer points than this are built by the task which finds
+     * them rather than by a new one, and point sets smaller than
+     * PARALLEL_SPLIT are split on one thread.
+     */
+    static const unsigned int PARALLEL_SUBTREE = 128;
+    static const unsigned int PARALLEL_SPLIT = 4096;
+
+    /**
+     * The first bytes of a saved tree, and the version of the layout that
+     * follows them (see save).
+     */
+    static const uint32_t FILE_MAGIC = 0x45525443;//"CTRE"
+    static const uint32_t FILE_VERSION = 2;
+
+    /**
+     * Lists every node breadth first from the root in nodes, and sets
+     * index[id] to the position in nodes of the node in slot id of the
+     * arena. This is the numbering of saved trees.
+     */
+    void breadthFirst(std::vector<const CoverTreeNode*>& nodes,
+                      std::vector<uint32_t>& index) const;
+
+    /**
+     * Returns the smallest level i such that base^i >= dist.
+     */
+    int getLevel(double dist) const;
+
+    /**
+     * Builds the tree from scratch out of points, top-down, in one pass,
+     * on threads threads (see workerCount). The tree must be empty.
+     */
+    void batch_create(const std::vector<Point>& points, unsigned int threads);
+
+    /**
+     * Adds a new node holding p, which is dist from n, to n as a child at
+     * level.
+     */
+    CoverTreeNode* batch_child(CoverTreeNode* n, int level, const Point& p,
+                               double dist, BatchState& state);
+
+    /**
+     * Batch construction (see batch_insert in langford/cover_tree.cc).
+     * The last entry of the distance stack of each point in pointSet is
+     * its distance to n. Makes every point of pointSet within base^level
+     * of n a descendant of n through children at levels <= level, together
+     * with any point in pointSet's caller's sets that lands near one of
+     * those new children. On return pointSet holds the points which were
+     * not consumed.
+     *
+     * Langford uses base^level as the radius within which a new child
+     * takes points, which only keeps the separation invariant when base
+     * is 2. The sets here reach as far as reach(level-1) instead, which is
+     * the same thing for base 2.
+     *
+     * With a pool, the subtrees of new children are built by tasks while
+     * further children are chosen. A child is only made while it is more
+     * than twice that radius from every child still being built, so none
+     * of the points either of them can take would be wanted by the other,
+     * and the result is one the sequential order could have produced too.
+     */
+    void batch_insert(CoverTreeNode* n, int level,
+                      std::vector<unsigned int>& pointSet,
+                      BatchState& state);
+
+    /**
+     * Moves every point of pointSet farther than sep from the node its
+     * last distance refers to into far.
+     */
+    void split(std::vector<unsigned int>& pointSet,
+               std::vector<unsigned int>& far,
+               double sep,
+               BatchState& state) const;
+
+    /**
+     * Moves every point of pointSet within sep of points[q] into newSet,
+     * pushing its distance to points[q] onto its distance stack.
+     * Large sets are measured in parallel when there is a pool.
+     */
+    void dist_split(std::vector<unsigned int>& pointSet,
+                    std::vector<unsigned int>& newSet,
+                    unsigned int q,
+                    double sep,
+                    BatchState& state) const;
 
  public:
-    const double base = 2.0;
+    static constexpr double base = double(Base::num)/Base::den;
+    static_assert(Base::num > Base::den && Base::num <= 2*Base::den,
+                  "the base of a cover tree must be in (1,2]");
 
     /**
      * Constructs a cover tree which begins with all points in points.
      *
-     * maxDist should be the maximum distance that any two points
-     * can have between each other. IE p.distance(q) < maxDist for all
-     * p,q that you will ever try to insert. The cover tree may be invalid
-     * if an inaccurate maxDist is given.
+     * The level of the root follows the points: it rises when a point
+     * arrives farther away than the tree reaches, and falls to the highest
+     * level holding anything but the root after batch construction and
+     * removals. No bound on the distances is needed up front.
+     *
+     * The initial points are placed with a single top-down batch
+     * construction rather than one insert() each. It runs on threads
+     * threads (0 means one per hardware thread); the tree may come out
+     * shaped differently from run to run when threads is not 1, but is
+     * always a valid cover tree of points.
+     */
+    explicit CoverTree(const std::vector<Point>& points=std::vector<Point>(),
+                       unsigned int threads = 1);
+
+    /**
+     * The same, for callers written when the tree had to be told the
+     * largest distance between two points. maxDist only sets the level
+     * the root starts at, and any value gives a valid tree.
      */
-    
     CoverTree(const double& maxDist,
-              const std::vector<Point>& points=std::vector<Point>()); 
+              const std::vector<Point>& points=std::vector<Point>(),
+              unsigned int threads = 1); 
     ~CoverTree();
 
+    CoverTree(const CoverTree&) = delete;
+    CoverTree& operator=(const CoverTree&) = delete;
+
+    /**
+     * Removes every point. This takes time linear in the number of nodes
+     * rather than a remove() per point, and keeps the memory of the nodes
+     * (and of the working sets of insert and remove) for the points
+     * inserted next, so refilling the tree mostly avoids the allocator.
+     */
+    void clear();
+
     /**
      * Just for testing/debugging. Returns true iff the cover tree satisfies the
      * the covering tree invariants (every node in level i is greater than base^i
@@ -158,220 +784,450 @@ class CoverTree
      */
     void remove(const Point& p);
 
+    /**
+     * Removes every point of points from the tree, as remove() does for
+     * each. One descent, shared by all of them, finds the nodes holding
+     * them; the subtrees below nodes left empty are then moved whole,
+     * highest first, to new parents, rather than their nodes being
+     * reparented one cover set scan at a time. When a large part of the
+     * tree goes, what is left is rebuilt with a batch construction
+     * instead. Points held by the root are taken out by remove() first,
+     * which is cheaper than moving every child of the root.
+     *
+     * Each call is recorded in operationStats() as one REMOVE_BATCH, and
+     * each point taken out of the root as a REMOVE. The distances of a
+     * rebuild are not recorded, as a batch construction's never are.
+     */
+    void removeBatch(const std::vector<Point>& points);
+
     /**
      * Returns the k nearest points to p in order (the 0th element of the vector
      * is closest to p, 1th is next, etc). It may return greater than k points
      * if there is a tie for the kth place.
+     *
+     * With epsilon > 0 the answer is only (1+epsilon)-approximate: the ith
+     * point returned is at most 1+epsilon times as far from p as the true
+     * ith nearest point. A subtree is then skipped unless it could hold a
+     * point more than 1+epsilon times nearer than the kth found so far, and
+     * the search stops at the first level at which none is left, so larger
+     * epsilons measure fewer distances and visit fewer levels.
+     */
+    std::vector<Point> kNearestNeighbors(const Point& p, const unsigned int& k,
+                                         double epsilon = 0.0) const;
+
+    /**
+     * Same as kNearestNeighbors(p,k,epsilon), but all working memory,
+     * including the result, lives in context, and the result points at the
+     * points stored in the tree instead of copying them. It stays valid
+     * until context is used again or the tree is modified.
+     */
+    const std::vector<const Point*>& kNearestNeighbors(const Point& p,
+                                                       const unsigned int& k,
+                                                       QueryContext& context,
+                                                       double epsilon = 0.0) const;
+
+    /**
+     * Returns every point within distance r of p (inclusive), nearest
+     * first. A subtree is skipped as soon as its root is farther than r
+     * plus the radius covered by its remaining levels, so the cost depends
+     * on how many points are found rather than on the size of the tree.
+     */
+    std::vector<Point> rangeSearch(const Point& p, double r) const;
+
+    /**
+     * Answers a k-nearest-neighbor query for every point in queries at
+     * once. Returns one (q, kNearestNeighbors(q,k)) pair for each point q in
+     * queries, in no particular order. Because the queries are themselves
+     * organised in a cover tree, queries that are close to each other share
+     * most of the search, which makes this much cheaper than asking for each
+     * point separately when the queries cluster.
+     */
+    std::vector<std::pair<Point, std::vector<Point> > >
+        kNearestNeighbors(const CoverTree<Point,Base,Stats>& queries,
+                          const unsigned int& k) const;
+
+    /**
+     * Returns kNearestNeighbors(queries[i],k,epsilon) as element i, for
+     * every i. The queries are spread over threads threads (0 means one
+     * per hardware thread) which steal work from each other, so uneven
+     * queries still keep every thread busy. Each thread reuses its own
+     * working memory. The tree must not be modified while this runs.
+     */
+    std::vector<std::vector<Point> >
+        kNearestNeighborsBatch(const std::vector<Point>& queries,
+                               const unsigned int& k,
+                               unsigned int threads = 0,
+                               double epsilon = 0.0) const;
+
+    /**
+     * Writes the tree to out in a compact binary layout: a header with
+     * the version of the layout, the base and the levels, then the points
+     * of every node, then the children of every node and their distances
+     * to it (with nodes numbered breadth first from the root), then a
+     * checksum of all of it. Point must implement
+     * void Point::save(std::ostream&) const. Numbers are written in the
+     * byte order of this machine. Returns false if out failed.
+     */
+    bool save(std::ostream& out) const;
+
+    /**
+     * Replaces the contents of the tree with a tree written by save, read
+     * with one pass over in and no distance computations. Point must
+     * implement static Point Point::load(std::istream&), which leaves the
+     * stream failed if it can't read a point. The tree takes on the levels
+     * of the saved tree, whatever maxDist it was made with.
+     *
+     * Returns false, leaving the tree empty, if in doesn't hold a tree of
+     * this layout version and base, ends early, fails its checksum, or
+     * links its nodes into anything but a tree rooted at the first.
      */
-    std::vector<Point> kNearestNeighbors(const Point& p, const unsigned int& k) const;
+    bool load(std::istream& in);
 
     CoverTreeNode* getRoot() const;
 
+    /**
+     * Measures the shape of the tree (see Statistics), like height_dist,
+     * breadth_dist and depth_dist in langford/cover_tree.cc. Takes time
+     * linear in the number of nodes and computes no distances.
+     */
+    Statistics statistics() const;
+
+    /**
+     * A copy of the Stats of every insert, remove, range search and query
+     * made without a QueryContext so far (see the Stats parameter of the
+     * class). Queries through a context are in its stats instead, except
+     * that kNearestNeighborsBatch adds those of its own contexts here.
+     * Safe to call while other threads query the tree.
+     */
+    Stats operationStats() const;
+
+    /**
+     * Starts operationStats() over.
+     */
+    void clearOperationStats();
+
     /**
      * Print the cover tree.
      */
     void print() const;
 }; // CoverTree class
 
-template<class Point>
-CoverTree<Point>::CoverTree(const double& maxDist,
-                            const std::vector<Point>& points)
+template<class Point, class Base, class Stats>
+CoverTree<Point,Base,Stats>::CoverTree(const std::vector<Point>& points,
+                            unsigned int threads)
 {
     _root=NULL;
     _numNodes=0;
-    _maxLevel=ceilf(log(maxDist)/log(base));
+    _maxLevel=0;
     _minLevel=_maxLevel-1;
-    typename std::vector<Point>::const_iterator it;
-    for(it=points.begin(); it!=points.end(); ++it) {
-        this->insert(*it);
-    }
+    batch_create(points, threads);
 }
 
-template<class Point>
-CoverTree<Point>::~CoverTree()
+template<class Point, class Base, class Stats>
+CoverTree<Point,Base,Stats>::CoverTree(const double& maxDist,
+                            const std::vector<Point>& points,
+                            unsigned int threads)
 {
-    if(_root==NULL) return;
-    //Get all of the root's children (from any level),
-    //delete the root, repeat for each of the children
-    std::vector<CoverTreeNode*> nodes;
-    nodes.push_back(_root);
-    while(!nodes.empty()) {
-        CoverTreeNode* byeNode = nodes[0];
-        nodes.erase(nodes.begin());
-        std::vector<CoverTreeNode*> children = byeNode->getAllChildren();
-        nodes.insert(nodes.begin(),children.begin(),children.end());
-        //std::cout << _numNodes << "\n";
-        delete byeNode;
-        //_numNodes--;
-    }   
+    _root=NULL;
+    _numNodes=0;
+    _maxLevel=maxDist > 0.0 ? getLevel(maxDist) : 0;
+    _minLevel=_maxLevel-1;
+    batch_create(points, threads);
 }
 
-template<class Point>
-std::vector<typename CoverTree<Point>::CoverTreeNode*>
-CoverTree<Point>::kNearestNodes(const Point& p, const unsigned int& k) const
+template<class Point, class Base, class Stats>
+CoverTree<Point,Base,Stats>::~CoverTree()
+{
+    //Every node lives in _arena, which releases them block by block.
+}
+
+template<class Point, class Base, class Stats>
+std::vector<typename CoverTree<Point,Base,Stats>::CoverTreeNode*>
+CoverTree<Point,Base,Stats>::kNearestNodes(const Point& p, const unsigned int& k) const
 {
-    if(_root==NULL) return std::vector<CoverTreeNode*>();
+    QueryContext context;
+    kNearestNodes(p, k, context);
+    record(context.operation);
+    std::vector<CoverTreeNode*> kNN;
+    typename std::vector<distNodePair>::const_iterator it;
+    for(it=context.nearest.begin();it!=context.nearest.end();++it) {
+        kNN.push_back(it->second);
+    }
+    return kNN;
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::kNearestNodes(const Point& p, const unsigned int& k,
+                                     QueryContext& context, double epsilon) const
+{
+    //minNodes stores the k nearest known points to p.
+    std::vector<distNodePair>& minNodes = context.nearest;
+    std::vector<distNodePair>& Qj = context.cover;
+    typename Stats::Operation& op = context.operation;
+    minNodes.clear();
+    Qj.clear();
+    op.begin(KNN_QUERY);
+    if(_root==NULL) return;
     //maxDist is the kth nearest known point to p, and also the farthest
-    //point from p in the set minNodes defined below.
+    //point from p in minNodes (the top of the heap).
     double maxDist = p.distance(_root->getPoint());
-    //minNodes stores the k nearest known points to p.
-    std::set<distNodePair> minNodes;
+    op.distance();
 
-    minNodes.insert(std::make_pair(maxDist,_root));
-    std::vector<distNodePair> Qj(1,std::make_pair(maxDist,_root));
-    for(int level = _maxLevel; level>=_minLevel;level--) {
-        typename std::vector<distNodePair>::const_iterator it;
+    //only points nearer than the kth so far by this factor are sought
+    double shrink = 1.0/(1.0+std::max(epsilon, 0.0));
+
+    minNodes.push_back(std::make_pair(maxDist,_root));
+    Qj.push_back(std::make_pair(maxDist,_root));
+    for(int level = _maxLevel; level>=_minLevel && !Qj.empty();level--) {
+        //how far below Qj any descendant still to be visited can be
+        double radius = reach(level-1);
         int size = Qj.size();
+        op.touch(size);
         for(int i=0; i<size; i++) {
-            std::vector<CoverTreeNode*> children =
-                Qj[i].second->getChildren(level);
-            typename std::vector<CoverTreeNode*>::const_iterator it2;
+            double parentDist = Qj[i].first;
+            ChildRange children = Qj[i].second->children(level);
+            typename ChildRange::const_iterator it2;
             for(it2=children.begin(); it2!=children.end(); ++it2) {
-                double d = p.distance((*it2)->getPoint());
-                if(d < maxDist || minNodes.size() < k) {
-                    minNodes.insert(std::make_pair(d,*it2));
-                    //--minNodes.end() gives us an iterator to the greatest
-                    //element of minNodes.
-                    if(minNodes.size() > k) minNodes.erase(--minNodes.end());
-                    maxDist = (--minNodes.end())->first;
+                //anything farther than this is dropped from Qj below
+                double bound = minNodes.size() < k ? DBL_MAX
+                    : maxDist*shrink + std::min(radius, (*it2)->radius());
+                //by the triangle inequality, the child is at least this far
+                //from p, which may be enough to skip it without measuring
+                if(std::fabs(parentDist-(*it2)->parentDistance()) > bound) {
+                    op.prune(1);
+                    continue;
                 }
-                Qj.push_back(std::make_pair(d,*it2));
-            }
-        }
-        double sep = maxDist + pow(base, level);
-        size = Qj.size();
-        for(int i=0; i<size; i++) {
-            if(Qj[i].first > sep) {
-                //quickly removes an element from a vector w/o preserving order.
-                Qj[i]=Qj.back();
-                Qj.pop_back();
-                size--; i--;
+                double d = distance(p, (*it2)->getPoint(), bound);
+                op.distance();
+                //past bound d may only be a partial sum, which with epsilon
+                //> 0 can still be under maxDist; the child would be
+                //dropped from Qj anyway
+                if(d > bound) {
+                    op.prune(1);
+                    continue;
+                }
+                distNodePair dn = std::make_pair(d,*it2);
+                if(minNodes.size() < k) {
+                    minNodes.push_back(dn);
+                    std::push_heap(minNodes.begin(), minNodes.end());
+                    maxDist = minNodes.front().first;
+                } else if(dn < minNodes.front()) {
+                    std::pop_heap(minNodes.begin(), minNodes.end());
+                    minNodes.back() = dn;
+                    std::push_heap(minNodes.begin(), minNodes.end());
+                    maxDist = minNodes.front().first;
+                }
+                Qj.push_back(dn);
             }
         }
+        //until k nodes are found every node of Qj is one of them, so
+        //none is pruned
+        op.prune(prune(Qj, minNodes.size() < k ? maxDist : maxDist*shrink,
+                       radius));
+        op.level(Qj.size());
     }
-    std::vector<CoverTreeNode*> kNN;
-    typename std::set<distNodePair>::const_iterator it;
-    for(it=minNodes.begin();it!=minNodes.end();++it) {
-        kNN.push_back(it->second);
+    std::sort_heap(minNodes.begin(), minNodes.end());
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::LevelSets::reset(int top, int bottom)
+{
+    for(unsigned int i=0;i<_used;i++) _sets[i].clear();
+    _used = 0;
+    _top = top;
+    if(_sets.size() < (unsigned int)(top-bottom+1)) _sets.resize(top-bottom+1);
+}
+
+template<class Point, class Base, class Stats>
+std::vector<typename CoverTree<Point,Base,Stats>::distNodePair>&
+CoverTree<Point,Base,Stats>::LevelSets::operator[](int level)
+{
+    if(level > _top) {
+        //never expected, as remove raises the root level first
+        _sets.insert(_sets.begin(), level-_top, std::vector<distNodePair>());
+        _used += level-_top;
+        _top = level;
     }
-    return kNN;
+    unsigned int i = _top-level;
+    if(i >= _sets.size()) _sets.resize(i+1);
+    if(i >= _used) _used = i+1;
+    return _sets[i];
 }
-template<class Point>
-bool CoverTree<Point>::insert_rec(const Point& p,
-                                  const std::vector<distNodePair>& Qi,
-                                  const int& level)
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::insert_iter(const Point& p)
 {
-    std::vector<std::pair<double, CoverTreeNode*> > Qj;
-    double sep = pow(base,level);
-    double minDist = DBL_MAX;
-    std::pair<double,CoverTreeNode*> minQiDist(DBL_MAX,NULL);
-    typename  std::vector<std::pair<double, CoverTreeNode*> >::const_iterator it;
-    for(it=Qi.begin(); it!=Qi.end(); ++it) {
-        if(it->first<minQiDist.first) minQiDist = *it;
-        if(it->first<minDist) minDist=it->first;
-        if(it->first<=sep) Qj.push_back(*it);
-        std::vector<CoverTreeNode*> children = it->second->getChildren(level);
-        typename std::vector<CoverTreeNode*>::const_iterator it2;
-        for(it2=children.begin();it2!=children.end();++it2) {
-            double d = p.distance((*it2)->getPoint());
-            if(d<minDist) minDist = d;
-            if(d<=sep) {
-                Qj.push_back(std::make_pair(d,*it2));
+    double rootDist = _root->distance(p);
+    _operation.distance();
+    //Only the root is in the cover sets above _maxLevel, so raising it is
+    //always safe. A lone root has no level yet and takes p's.
+    if(_numNodes==1 && rootDist > 0.0) {
+        _maxLevel = getLevel(rootDist);
+        _minLevel = _maxLevel-1;
+    } else if(rootDist > scale(_maxLevel)) {
+        _maxLevel = getLevel(rootDist);
+    }
+    LevelSets& Q = _levelSets;
+    Q.reset(_maxLevel, _minLevel-1);
+    _steps.clear();
+    Q[_maxLevel].push_back(std::make_pair(rootDist,_root));
+    int level = _maxLevel;
+    //descend while some node of the next cover set is within base^level
+    while(true) {
+        std::vector<distNodePair>& Qj = Q[level-1];
+        const std::vector<distNodePair>& Qi = Q[level];
+        //Qj keeps every node of its cover set within keep of p, which
+        //includes every parent of a node within reach(level-2) of p one
+        //level down. keep is base^level when base is 2.
+        double keep = reach(level-1);
+        double minDist = DBL_MAX;
+        LevelStep step = {NULL, DBL_MAX, NULL};
+        _operation.touch(Qi.size());
+        typename std::vector<distNodePair>::const_iterator it;
+        for(it=Qi.begin(); it!=Qi.end(); ++it) {
+            //only the root can get here with distance 0; any deeper node
+            //would have been caught as a child one level up
+            if(it->first==0.0) {
+                it->second->addPoint(p);
+                return;
+            }
+            if(it->first<step.dist) {
+                step.node = it->second;
+                step.dist = it->first;
+            }
+            if(it->first<minDist) minDist=it->first;
+            if(it->first<=keep) Qj.push_back(*it);
+            else _operation.prune(1);
+            ChildRange children = it->second->children(level);
+            typename ChildRange::const_iterator it2;
+            for(it2=children.begin();it2!=children.end();++it2) {
+                //a child which can't be within keep can't be 0 away either
+                if(std::fabs(it->first-(*it2)->parentDistance()) > keep) {
+                    _operation.prune(1);
+                    continue;
+                }
+                double d = distance(p, (*it2)->getPoint(), keep);
+                _operation.distance();
+                //every node with distance 0 to p is reached before the
+                //descent can stop (see insert)
+                if(d==0.0) {
+                    (*it2)->addPoint(p);
+                    return;
+                }
+                if(d<minDist) minDist = d;
+                if(d<=keep) {
+                    Qj.push_back(std::make_pair(d,*it2));
+                } else {
+                    _operation.prune(1);
+                }
             }
         }
+        _operation.level(Qj.size());
+        _steps.push_back(step);
+        //nothing further down is within base^i of p at any level i
+        if(minDist > keep) break;
+        level--;
     }
-    //std::cout << "level: " << level << ", sep: " << sep << ", dist: " << minQDist.first << "\n";
-    if(minDist > sep) {
-        return true;
-    } else {
-        bool found = insert_rec(p,Qj,level-1);
-        //distNodePair minQiDist = distance(p,Qi);
-        if(found && minQiDist.first <= sep) {
+    //p's parent is the nearest node of the lowest cover set above here
+    //which is close enough
+    for(level++;level<=_maxLevel;level++) {
+        const LevelStep& step = _steps[_maxLevel-level];
+        if(step.dist <= scale(level)) {
             if(level-1<_minLevel) _minLevel=level-1;
-            minQiDist.second->addChild(level,
-                                       new CoverTreeNode(p));
-            //std::cout << "parent is ";
-            //minQiDist.second->getPoint().print();
+            step.node->addChild(level, _arena.create(p), step.dist);
+            grow(step.node, step.dist);
             _numNodes++;
-            return false;
-        } else {
-            return found;
+            return;
         }
     }
 }
 
-template<class Point>
-void CoverTree<Point>::remove_rec(const Point& p,
-                                  std::map<int,std::vector<distNodePair> >& coverSets,
-                                  int level,
-                                  bool& multi)
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::remove_iter(const Point& p)
 {
-    std::vector<distNodePair>& Qi = coverSets[level];
-    std::vector<distNodePair>& Qj = coverSets[level-1];
-    double minDist = DBL_MAX;
-    CoverTreeNode* minNode = _root;
-    CoverTreeNode* parent = 0;
-    double sep = pow(base, level);
-    typename std::vector<distNodePair>::const_iterator it;
-    //set Qj to be all children q of Qi such that p.distance(q)<=sep
-    //and also keep track of the minimum distance from p to a node in Qj
-    //note that every node has itself as a child, but the
-    //getChildren function only returns non-self-children.
-    for(it=Qi.begin();it!=Qi.end();++it) {
-        std::vector<CoverTreeNode*> children = it->second->getChildren(level);
-        double dist = it->first;
-        if(dist<minDist) {
-            minDist = dist;
-            minNode = it->second;
-        }
-        if(dist <= sep) {
-            Qj.push_back(*it);
-        }
-        typename std::vector<CoverTreeNode*>::const_iterator it2;
-        for(it2=children.begin();it2!=children.end();++it2) {
-            dist = p.distance((*it2)->getPoint());
-            if(dist<minDist) {
-                minDist = dist;
-                minNode = *it2;
-                if(dist == 0.0) parent = it->second;
+    LevelSets& coverSets = _levelSets;
+    _steps.clear();
+    //set each Q_{i-1} to be all children q of Q_i such that
+    //p.distance(q)<=base^i and also keep track of the node nearest to p.
+    //note that every node has itself as a child, but the children
+    //function only returns non-self-children.
+    for(int level=_maxLevel;;level--) {
+        std::vector<distNodePair>& Qj = coverSets[level-1];
+        const std::vector<distNodePair>& Qi = coverSets[level];
+        LevelStep step = {_root, DBL_MAX, NULL};
+        double sep = reach(level-1);//as in insert_iter
+        _operation.touch(Qi.size());
+        typename std::vector<distNodePair>::const_iterator it;
+        for(it=Qi.begin();it!=Qi.end();++it) {
+            ChildRange children = it->second->children(level);
+            double dist = it->first;
+            if(dist<step.dist) {
+                step.dist = dist;
+                step.node = it->second;
             }
             if(dist <= sep) {
-                Qj.push_back(std::make_pair(dist,*it2));
+                Qj.push_back(*it);
+            } else {
+                _operation.prune(1);
+            }
+            typename ChildRange::const_iterator it2;
+            for(it2=children.begin();it2!=children.end();++it2) {
+                //too far to keep, and so too far to hold p
+                if(std::fabs(it->first-(*it2)->parentDistance()) > sep) {
+                    _operation.prune(1);
+                    continue;
+                }
+                dist = distance(p, (*it2)->getPoint(), sep);
+                _operation.distance();
+                if(dist<step.dist) {
+                    step.dist = dist;
+                    step.node = *it2;
+                    if(dist == 0.0) step.parent = it->second;
+                }
+                if(dist <= sep) {
+                    Qj.push_back(std::make_pair(dist,*it2));
+                } else {
+                    _operation.prune(1);
+                }
             }
         }
+        _operation.level(Qj.size());
+        _steps.push_back(step);
+        if(level<=_minLevel) break;
     }
-    if(level>_minLevel) remove_rec(p,coverSets,level-1,multi);
-    if(minNode->hasPoint(p)) {
-        //the multi flag indicates the point we removed is from a
-        //node containing multiple points, and we have removed it,
-        //so we don't need to do anything else.
-        if(multi) return;
+    //then work back up from the lowest level, as the recursion used to
+    for(int depth=_steps.size()-1;depth>=0;depth--) {
+        int level = _maxLevel-depth;
+        CoverTreeNode* minNode = _steps[depth].node;
+        CoverTreeNode* parent = _steps[depth].parent;
+        if(!minNode->hasPoint(p)) continue;
+        //the point we removed is from a node containing multiple points,
+        //and we have removed it, so we don't need to do anything else.
         if(!minNode->isSingle()) {
             minNode->removePoint(p);
-            multi=true;
             return;
         }
         if(parent!=NULL) parent->removeChild(level, minNode);
+        //copied because minNode itself may still be in a higher cover set
+        //and so can be handed children below while we iterate.
         std::vector<CoverTreeNode*> children = minNode->getChildren(level-1);
         std::vector<distNodePair>& Q = coverSets[level-1];
-        if(Q.size()==1 && Q[0].second==minNode) {
-            Q.pop_back();
-        } else {
-            for(unsigned int i=0;i<Q.size();i++) {
-                if(Q[i].second==minNode) {
-                    Q[i]=Q.back();
-                    Q.pop_back();
-                    break;
-                }
+        for(unsigned int i=0;i<Q.size();i++) {
+            if(Q[i].second==minNode) {
+                Q[i]=Q.back();
+                Q.pop_back();
+                break;
             }
         }
         typename std::vector<CoverTreeNode*>::const_iterator it;
         for(it=children.begin();it!=children.end();++it) {
             int i = level-1;
             Point q = (*it)->getPoint();
+            //minNode holds only p, so this is the distance from q to p
+            double dist = (*it)->parentDistance();
             double minDQ = DBL_MAX;
             CoverTreeNode* minDQNode;
-            double sep = pow(base,i);
+            double sep = scale(i);
             bool br=false;
             while(true) {
                 std::vector<distNodePair>&
@@ -379,7 +1235,9 @@ void CoverTree<Point>::remove_rec(const Point& p,
                 typename std::vector<distNodePair>::const_iterator it2;
                 minDQ = DBL_MAX;
                 for(it2=Q.begin();it2!=Q.end();++it2) {
-                    double d = q.distance(it2->second->getPoint());
+                    if(std::fabs(it2->first-dist) > sep) continue;
+                    double d = distance(q, it2->second->getPoint(), sep);
+                    _operation.distance();
                     if(d<minDQ) {
                         minDQ = d;
                         minDQNode = it2->second;
@@ -389,27 +1247,295 @@ void CoverTree<Point>::remove_rec(const Point& p,
                         }
                     }
                 }
-                minDQ=DBL_MAX;
                 if(br) break;
-                Q.push_back(std::make_pair((*it)->distance(p),*it));
+                Q.push_back(std::make_pair(dist,*it));
                 i++;
-                sep = pow(base,i);
+                sep = scale(i);
+            }
+            minDQNode->addChild(i,*it,minDQ);
+            grow(minDQNode, minDQ+(*it)->radius());
+        }
+        if(parent!=NULL) {
+            _arena.destroy(minNode);
+            _numNodes--;
+        }
+    }
+}
+
+template<class Point, class Base, class Stats>
+int CoverTree<Point,Base,Stats>::getLevel(double dist) const
+{
+    int level = ceil(log(dist)/log(base));
+    //correct for rounding in the logarithms
+    while(scale(level) < dist) level++;
+    while(scale(level-1) >= dist) level--;
+    return level;
+}
+
+template<class Point, class Base, class Stats>
+std::vector<unsigned int> CoverTree<Point,Base,Stats>::BatchState::take()
+{
+    std::vector<unsigned int> set;
+    std::lock_guard<std::mutex> guard(lock);
+    if(!spare.empty()) {
+        set.swap(spare.back());
+        spare.pop_back();
+    }
+    return set;
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::BatchState::give(std::vector<unsigned int>& set)
+{
+    set.clear();
+    std::lock_guard<std::mutex> guard(lock);
+    spare.push_back(std::vector<unsigned int>());
+    spare.back().swap(set);
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::batch_create(const std::vector<Point>& points,
+                                    unsigned int threads)
+{
+    if(points.empty()) return;
+    threads = workerCount(threads, points.size());
+    std::unique_ptr<TaskPool> pool;
+    if(threads > 1) pool.reset(new TaskPool(threads));
+    BatchState state(points, pool.get());
+    _root = _arena.create(points[0]);
+    _numNodes = 1;
+    std::vector<double> dists(points.size());
+    auto measure = [&](std::size_t i) {
+        dists[i] = points[i].distance(points[0]);
+    };
+    if(pool) pool->forEach(points.size(), PARALLEL_SPLIT/4, measure);
+    else for(unsigned int i=0;i<points.size();i++) measure(i);
+    std::vector<unsigned int> pointSet;
+    double maxDist = 0.0;
+    for(unsigned int i=1;i<points.size();i++) {
+        state.dists[i].push_back(dists[i]);
+        pointSet.push_back(i);
+        if(dists[i] > maxDist) maxDist = dists[i];
+    }
+    //the root starts at the level which covers the farthest point, and
+    //batch_child lowers _minLevel from just below it
+    if(maxDist > 0.0) {
+        _maxLevel = getLevel(maxDist);
+        _minLevel = _maxLevel-1;
+    }
+    batch_insert(_root, _maxLevel, pointSet, state);
+    if(pool) pool->rethrow();
+    computeRadii();
+    fitRoot();
+}
+
+template<class Point, class Base, class Stats>
+typename CoverTree<Point,Base,Stats>::CoverTreeNode*
+CoverTree<Point,Base,Stats>::batch_child(CoverTreeNode* n, int level, const Point& p,
+                              double dist, BatchState& state)
+{
+    CoverTreeNode* child;
+    {
+        std::lock_guard<std::mutex> guard(state.lock);
+        child = _arena.create(p);
+        _numNodes++;
+        if(level-1<_minLevel) _minLevel=level-1;
+    }
+    //only the task building n's subtree touches n
+    n->addChild(level, child, dist);
+    return child;
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::batch_insert(CoverTreeNode* n, int level,
+                                    std::vector<unsigned int>& pointSet,
+                                    BatchState& state)
+{
+    if(pointSet.empty()) return;
+    double maxDist = 0.0;
+    typename std::vector<unsigned int>::const_iterator it;
+    for(it=pointSet.begin();it!=pointSet.end();++it) {
+        if(state.dists[*it].back() > maxDist)
+            maxDist = state.dists[*it].back();
+    }
+    if(maxDist == 0.0) {
+        //everything left has distance 0 to n, so it belongs in n itself.
+        for(it=pointSet.begin();it!=pointSet.end();++it) {
+            n->addPoint(state.points[*it]);
+        }
+        pointSet.clear();
+        return;
+    }
+    int nextLevel = std::min(level-1, getLevel(maxDist));
+    double sep = scale(level);
+    //how far from a child at this level a point can be and still end up
+    //near its subtree; base^level when base is 2
+    double pull = reach(level-1);
+    std::vector<unsigned int> far = state.take();
+    split(pointSet, far, pull, state);
+    //n's self-child takes every point that fits below nextLevel...
+    batch_insert(n, nextLevel, pointSet, state);
+    //...and each point left within base^level becomes a new child of n at
+    //this level, taking with it everything (near or far) within pull of it.
+    split(pointSet, far, sep, state);
+    if(!pointSet.empty()) {
+        std::vector<unsigned int> newSet = state.take();
+        //children whose subtrees are still being built by other tasks
+        std::list<BatchChild> building;
+        //if anything below throws, they must still finish before it unwinds
+        struct Join
+        {
+            TaskPool* pool;
+            std::list<BatchChild>& building;
+            ~Join()
+            {
+                if(pool==NULL) return;
+                pool->waitUntil([this]() {
+                    typename std::list<BatchChild>::const_iterator b;
+                    for(b=building.begin();b!=building.end();++b) {
+                        if(!b->done.load()) return false;
+                    }
+                    return true;
+                });
+            }
+        } join = {state.pool, building};
+        while(!pointSet.empty() || !building.empty()) {
+            //hand back whatever finished children didn't consume
+            typename std::list<BatchChild>::iterator b = building.begin();
+            while(b!=building.end()) {
+                if(!b->done.load()) {
+                    ++b;
+                    continue;
+                }
+                for(it=b->set.begin();it!=b->set.end();++it) {
+                    state.dists[*it].pop_back();
+                    if(state.dists[*it].back() <= sep) pointSet.push_back(*it);
+                    else far.push_back(*it);
+                }
+                state.give(b->set);
+                b = building.erase(b);
+            }
+            //the next child must be clear of every child still building;
+            //only a few candidates are tried before waiting for one.
+            unsigned int next = pointSet.size();
+            if(building.empty() || building.size() < state.pool->size()) {
+                for(unsigned int i=pointSet.size(), tries=0;
+                    i>0 && tries<8 && next==pointSet.size(); i--, tries++) {
+                    const Point& q = state.points[pointSet[i-1]];
+                    next = i-1;
+                    for(b=building.begin();b!=building.end();++b) {
+                        if(distance(q, b->node->getPoint(), 2*pull) <= 2*pull) {
+                            next = pointSet.size();
+                            break;
+                        }
+                    }
+                }
+            }
+            if(next==pointSet.size()) {
+                //pointSet may have just been emptied by handing back
+                if(building.empty()) break;
+                state.pool->waitUntil([&]() {
+                    for(b=building.begin();b!=building.end();++b) {
+                        if(b->done.load()) return true;
+                    }
+                    return false;
+                });
+                continue;
+            }
+            unsigned int q = pointSet[next];
+            pointSet[next] = pointSet.back();
+            pointSet.pop_back();
+            CoverTreeNode* child = batch_child(n, level, state.points[q],
+                                               state.dists[q].back(), state);
+
+            dist_split(pointSet, newSet, q, pull, state);
+            dist_split(far, newSet, q, pull, state);
+            if(state.pool && newSet.size() >= PARALLEL_SUBTREE) {
+                building.emplace_back(child);
+                BatchChild& c = building.back();
+                c.set.swap(newSet);
+                newSet = state.take();
+                state.pool->spawn([this, &c, nextLevel, &state]() {
+                    batch_insert(c.node, nextLevel, c.set, state);
+                }, c.done);
+                continue;
+            }
+            batch_insert(child, nextLevel, newSet, state);
+
+            //hand back whatever the child didn't consume
+            for(it=newSet.begin();it!=newSet.end();++it) {
+                state.dists[*it].pop_back();
+                if(state.dists[*it].back() <= sep) pointSet.push_back(*it);
+                else far.push_back(*it);
+            }
+            newSet.clear();
+        }
+        state.give(newSet);
+    }
+    pointSet.swap(far);
+    state.give(far);
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::split(std::vector<unsigned int>& pointSet,
+                             std::vector<unsigned int>& far,
+                             double sep,
+                             BatchState& state) const
+{
+    unsigned int kept = 0;
+    for(unsigned int i=0;i<pointSet.size();i++) {
+        if(state.dists[pointSet[i]].back() <= sep) {
+            pointSet[kept++] = pointSet[i];
+        } else {
+            far.push_back(pointSet[i]);
+        }
+    }
+    pointSet.resize(kept);
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::dist_split(std::vector<unsigned int>& pointSet,
+                                  std::vector<unsigned int>& newSet,
+                                  unsigned int q,
+                                  double sep,
+                                  BatchState& state) const
+{
+    const Point& newPoint = state.points[q];
+    unsigned int kept = 0;
+    if(state.pool && pointSet.size() >= PARALLEL_SPLIT) {
+        //measure in parallel, then partition in order as below
+        std::vector<double> dists(pointSet.size());
+        state.pool->forEach(pointSet.size(), PARALLEL_SPLIT/4,
+                            [&](std::size_t i) {
+                                dists[i] = distance(state.points[pointSet[i]],
+                                                    newPoint, sep);
+                            });
+        for(unsigned int i=0;i<pointSet.size();i++) {
+            if(dists[i] <= sep) {
+                state.dists[pointSet[i]].push_back(dists[i]);
+                newSet.push_back(pointSet[i]);
+            } else {
+                pointSet[kept++] = pointSet[i];
             }
-            //minDQNode->getPoint().print();
-            //std::cout << " is level " << i << " parent of ";
-            //(*it)->getPoint().print();
-            minDQNode->addChild(i,*it);
         }
-        if(parent!=NULL) {
-            delete minNode;
-            _numNodes--;
+        pointSet.resize(kept);
+        return;
+    }
+    for(unsigned int i=0;i<pointSet.size();i++) {
+        double d = distance(state.points[pointSet[i]], newPoint, sep);
+        if(d <= sep) {
+            state.dists[pointSet[i]].push_back(d);
+            newSet.push_back(pointSet[i]);
+        } else {
+            pointSet[kept++] = pointSet[i];
         }
     }
+    pointSet.resize(kept);
 }
 
-template<class Point>
-std::pair<double, typename CoverTree<Point>::CoverTreeNode*>
-CoverTree<Point>::distance(const Point& p,
+template<class Point, class Base, class Stats>
+std::pair<double, typename CoverTree<Point,Base,Stats>::CoverTreeNode*>
+CoverTree<Point,Base,Stats>::distance(const Point& p,
                            const std::vector<CoverTreeNode*>& Q)
 {
     double minDist = DBL_MAX;
@@ -425,88 +1551,638 @@ CoverTree<Point>::distance(const Point& p,
     return std::make_pair(minDist,minNode);  
 }
 
-template<class Point>
-void CoverTree<Point>::insert(const Point& newPoint)
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::insert(const Point& newPoint)
 {
+    _operation.begin(INSERT);
     if(_root==NULL) {
-        _root = new CoverTreeNode(newPoint);
+        _root = _arena.create(newPoint);
         _numNodes=1;
-        return;
-    }
-    //TODO: this is pretty inefficient, there may be a better way
-    //to check if the node already exists...
-    CoverTreeNode* n = kNearestNodes(newPoint,1)[0];
-    if(newPoint.distance(n->getPoint())==0.0) {
-        n->addPoint(newPoint);
     } else {
-        //insert_rec acts under the assumption that there are no nodes with
-        //distance 0 to newPoint in the cover tree (the previous lines check it)
-        insert_rec(newPoint,
-                   std::vector<distNodePair>
-                   (1,std::make_pair(_root->distance(newPoint),_root)),
-                   _maxLevel);
+        //A node with distance 0 to newPoint is in some cover set, and its
+        //ancestor in every higher cover set i is less than reach(i) from
+        //newPoint, so insert_iter never gives up above it, and finds it on
+        //the way down rather than needing a nearest neighbor search first.
+        insert_iter(newPoint);
     }
+    record(_operation);
 }
 
-template<class Point>
-void CoverTree<Point>::remove(const Point& p)
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::remove(const Point& p)
 {
     //Most of this function's code is for the special case of removing the root
-    if(_root==NULL) return;
+    _operation.begin(REMOVE);
+    if(_root==NULL) {
+        record(_operation);
+        return;
+    }
     bool removingRoot=_root->hasPoint(p);
     if(removingRoot && !_root->isSingle()) {
         _root->removePoint(p);
+        record(_operation);
         return;
     }
     CoverTreeNode* newRoot=NULL;
+    //an upper bound on the distance from the root, or from the node that
+    //will replace it, to any node
+    double span = _root->radius();
     if(removingRoot) {
         if(_numNodes==1) {
             //removing the last node...
-            delete _root;
+            _arena.destroy(_root);
             _numNodes--;
             _root=NULL;
+            record(_operation);
             return;
         } else {
             for(int i=_maxLevel;i>_minLevel;i--) {
-                if(!(_root->getChildren(i).empty())) {
-                    newRoot = _root->getChildren(i).back();
+                if(!(_root->children(i).empty())) {
+                    newRoot = _root->children(i).back();
+                    span += newRoot->parentDistance();
                     _root->removeChild(i,newRoot);
                     break;
                 }
             }
         }
     }
-    std::map<int, std::vector<distNodePair> > coverSets;
-    coverSets[_maxLevel].push_back(std::make_pair(_root->distance(p),_root));
-    if(removingRoot)
-        coverSets[_maxLevel].push_back(std::make_pair(newRoot->distance(p),newRoot));
-    bool multi = false;
-    remove_rec(p,coverSets,_maxLevel,multi);
+    //remove_iter moves each orphan up the cover sets until one holds a
+    //node near enough to be its parent. The root must be one by the top,
+    //or by the level below it when it is replacing the old root, which
+    //is still in the top cover set; fitRoot lowers the level again after.
+    if(span > 0.0) {
+        _maxLevel = std::max(_maxLevel, getLevel(span) + (removingRoot ? 1 : 0));
+    }
+    _levelSets.reset(_maxLevel, _minLevel-1);
+    std::vector<distNodePair>& top = _levelSets[_maxLevel];
+    top.push_back(std::make_pair(_root->distance(p),_root));
+    _operation.distance();
     if(removingRoot) {
-        delete _root;
+        top.push_back(std::make_pair(newRoot->distance(p),newRoot));
+        _operation.distance();
+    }
+    remove_iter(p);
+    record(_operation);
+    if(removingRoot) {
+        _arena.destroy(_root);
         _numNodes--;
         _root=newRoot;
     }
+    fitRoot();
 }
 
-template<class Point>
-std::vector<Point> CoverTree<Point>::kNearestNeighbors(const Point& p,
-                                                       const unsigned int& k) const
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::locate(CoverTreeNode* n, const std::vector<Point>& victims,
+                                   const std::vector<distIndexPair>& cands,
+                                   std::vector<std::pair<CoverTreeNode*, unsigned int> >& found,
+                                   std::vector<std::vector<distIndexPair> >& scratch,
+                                   unsigned int depth)
+{
+    if(scratch.size() <= depth) scratch.resize(depth+1);
+    //a point 0 away is in n or nowhere, since such points share a node
+    typename std::vector<distIndexPair>::const_iterator it;
+    for(it=cands.begin();it!=cands.end();++it) {
+        if(it->first==0.0) found.push_back(std::make_pair(n, it->second));
+    }
+    ChildRange children = n->allChildren();
+    if(!children.empty()) _operation.touch(cands.size());
+    for(unsigned int i=0;i<children.size();i++) {
+        CoverTreeNode* c = children[i];
+        //borrowed from scratch, which the calls below may grow
+        std::vector<distIndexPair> next;
+        next.swap(scratch[depth]);
+        next.clear();
+        for(it=cands.begin();it!=cands.end();++it) {
+            if(it->first==0.0) continue;
+            //the radius already allows for its own rounding; this allows
+            //for that of the distances it is compared with
+            double within = c->radius() + (c->radius()+it->first)*RADIUS_SLACK;
+            if(std::fabs(it->first-c->parentDistance()) > within) {
+                _operation.prune(1);
+                continue;
+            }
+            double d = distance(victims[it->second], c->getPoint(), within);
+            _operation.distance();
+            if(d <= within) next.push_back(std::make_pair(d, it->second));
+            else _operation.prune(1);
+        }
+        if(!next.empty()) locate(c, victims, next, found, scratch, depth+1);
+        next.swap(scratch[depth]);
+    }
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::reattach(CoverTreeNode* n, int lowest)
+{
+    const Point& p = n->getPoint();
+    LevelSets& Q = _levelSets;
+    Q.reset(_maxLevel, lowest-1);
+    _steps.clear();
+    Q[_maxLevel].push_back(std::make_pair(_root->distance(p),_root));
+    _operation.distance();
+    int level = _maxLevel;
+    while(true) {
+        std::vector<distNodePair>& Qj = Q[level-1];
+        const std::vector<distNodePair>& Qi = Q[level];
+        double keep = reach(level-1);//as in insert_iter
+        double minDist = DBL_MAX;
+        LevelStep step = {NULL, DBL_MAX, NULL};
+        _operation.touch(Qi.size());
+        typename std::vector<distNodePair>::const_iterator it;
+        for(it=Qi.begin(); it!=Qi.end(); ++it) {
+            if(it->first<step.dist) {
+                step.node = it->second;
+                step.dist = it->first;
+            }
+            if(it->first<minDist) minDist=it->first;
+            if(it->first<=keep) Qj.push_back(*it);
+            else _operation.prune(1);
+            ChildRange children = it->second->children(level);
+            typename ChildRange::const_iterator it2;
+            for(it2=children.begin();it2!=children.end();++it2) {
+                if(std::fabs(it->first-(*it2)->parentDistance()) > keep) {
+                    _operation.prune(1);
+                    continue;
+                }
+                double d = distance(p, (*it2)->getPoint(), keep);
+                _operation.distance();
+                if(d<minDist) minDist = d;
+                if(d<=keep) Qj.push_back(std::make_pair(d,*it2));
+                else _operation.prune(1);
+            }
+        }
+        _operation.level(Qj.size());
+        _steps.push_back(step);
+        if(minDist > keep || level<=lowest) break;
+        level--;
+    }
+    //the lowest level which has a parent for n; below level it would need
+    //a parent in a cover set known to have nothing near n, and at lowest
+    //the caller vouches for the separation
+    for(int i=level;i<=_maxLevel;i++) {
+        const LevelStep& step = _steps[_maxLevel-i];
+        if(step.dist > scale(i)) continue;
+        if(i-1<_minLevel) _minLevel=i-1;
+        step.node->addChild(i, n, step.dist);
+        grow(step.node, step.dist+n->radius());
+        return;
+    }
+    //n is out of reach of the root, which rises to take it as insert_iter
+    //would (_steps[0] is the root, alone in the top cover set)
+    _maxLevel = getLevel(_steps[0].dist);
+    _root->addChild(_maxLevel, n, _steps[0].dist);
+    grow(_root, _steps[0].dist+n->radius());
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::removeBatch(const std::vector<Point>& points)
+{
+    //Taking the root out here would move every one of its children, each
+    //from a descent of its own, which costs more than the rest of a small
+    //batch; remove() does it far more cheaply. A new root may hold points
+    //of the batch too, so this goes on until the root holds none.
+    std::vector<bool> taken(points.size(), false);
+    bool anyTaken = false, again = true;
+    while(again && _root!=NULL) {
+        again = false;
+        for(unsigned int i=0;i<points.size() && _root!=NULL;i++) {
+            if(taken[i] || !_root->hasPoint(points[i])) continue;
+            remove(points[i]);
+            taken[i] = anyTaken = again = true;
+        }
+    }
+    std::vector<Point> others;
+    if(anyTaken) {
+        for(unsigned int i=0;i<points.size();i++) {
+            if(!taken[i]) others.push_back(points[i]);
+        }
+    }
+    const std::vector<Point>& victims = anyTaken ? others : points;
+
+    _operation.begin(REMOVE_BATCH);
+    if(_root==NULL || victims.empty()) {
+        record(_operation);
+        return;
+    }
+    std::vector<distIndexPair> cands;
+    for(unsigned int i=0;i<victims.size();i++) {
+        cands.push_back(std::make_pair(_root->distance(victims[i]), i));
+        _operation.distance();
+    }
+    std::vector<std::pair<CoverTreeNode*, unsigned int> > found;
+    std::vector<std::vector<distIndexPair> > scratch;
+    locate(_root, victims, cands, found, scratch, 0);
+
+    //take the points out; nodes left with none have to go
+    std::vector<CoverTreeNode*> doomed;
+    typename std::vector<std::pair<CoverTreeNode*, unsigned int> >::const_iterator f;
+    for(f=found.begin();f!=found.end();++f) {
+        if(!f->first->hasPoint(victims[f->second])) continue;
+        f->first->removePoint(victims[f->second]);
+        if(f->first->getPoints().empty()) doomed.push_back(f->first);
+    }
+    if(doomed.empty()) {
+        record(_operation);
+        return;
+    }
+
+    //rebuilding costs about as much as moving this many subtrees
+    if(doomed.size() > _numNodes/4) {
+        std::vector<Point> rest;
+        rest.reserve(_numNodes);
+        std::vector<CoverTreeNode*> nodes(1,_root);
+        for(unsigned int i=0;i<nodes.size();i++) {
+            const std::vector<Point>& p = nodes[i]->getPoints();
+            rest.insert(rest.end(),p.begin(),p.end());
+            ChildRange children = nodes[i]->allChildren();
+            nodes.insert(nodes.end(),children.begin(),children.end());
+        }
+        clear();
+        batch_create(rest, 1);
+        record(_operation);
+        return;
+    }
+
+    //cut every surviving child of a doomed node loose, remembering the
+    //level it was a child at, and free the doomed nodes (never the root,
+    //which holds none of the victims)
+    std::vector<bool> isDoomed(_arena.size(), false);
+    typename std::vector<CoverTreeNode*>::const_iterator d;
+    for(d=doomed.begin();d!=doomed.end();++d) isDoomed[(*d)->getId()] = true;
+    //(level, id) of each subtree to put back, highest level on top
+    std::priority_queue<std::pair<int, unsigned int> > orphans;
+    for(d=doomed.begin();d!=doomed.end();++d) {
+        ChildRange children = (*d)->allChildren();
+        for(unsigned int i=0;i<children.size();i++) {
+            if(!isDoomed[children[i]->getId()]) {
+                orphans.push(std::make_pair((*d)->childLevel(i), children[i]->getId()));
+            }
+        }
+        CoverTreeNode* parent = (*d)->getParent();
+        if(parent!=NULL && !isDoomed[parent->getId()]) {
+            ChildRange siblings = parent->allChildren();
+            for(unsigned int i=0;i<siblings.size();i++) {
+                if(siblings[i]==*d) {
+                    parent->removeChild(parent->childLevel(i), *d);
+                    break;
+                }
+            }
+        }
+    }
+    for(d=doomed.begin();d!=doomed.end();++d) {
+        _arena.destroy(*d);
+        _numNodes--;
+    }
+
+    //Each subtree goes back no lower than it was, and nodes only ever
+    //move up, so every node of the cover set below an orphan's old level
+    //was in it before, beside the orphan, and is still separated from it.
+    //Taken highest first, the orphans never need to move each other.
+    while(!orphans.empty()) {
+        int level = orphans.top().first;
+        CoverTreeNode* n = _arena.at(orphans.top().second);
+        orphans.pop();
+        reattach(n, level);
+    }
+    fitRoot();
+    record(_operation);
+}
+
+template<class Point, class Base, class Stats>
+std::vector<Point> CoverTree<Point,Base,Stats>::kNearestNeighbors(const Point& p,
+                                                       const unsigned int& k,
+                                                       double epsilon) const
 {
-    if(_root==NULL) return std::vector<Point>();
-    std::vector<CoverTreeNode*> v = kNearestNodes(p, k);
+    QueryContext context;
     std::vector<Point> kNN;
-    typename std::vector<CoverTreeNode*>::const_iterator it;
-    for(it=v.begin();it!=v.end();++it) {
-        const std::vector<Point>& p = (*it)->getPoints();
+    kNearestNeighbors(p, k, context, kNN, epsilon);
+    record(context.operation);
+    return kNN;
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::kNearestNeighbors(const Point& p, const unsigned int& k,
+                                         QueryContext& context,
+                                         std::vector<Point>& kNN,
+                                         double epsilon) const
+{
+    kNearestNodes(p, k, context, epsilon);
+    unsigned int found = 0;
+    typename std::vector<distNodePair>::const_iterator it;
+    for(it=context.nearest.begin();it!=context.nearest.end();++it) {
+        const std::vector<Point>& p = it->second->getPoints();
+        kNN.insert(kNN.end(),p.begin(),p.end());
+        found += p.size();
+        if(found >= k) break;
+    }
+}
+
+template<class Point, class Base, class Stats>
+const std::vector<const Point*>&
+CoverTree<Point,Base,Stats>::kNearestNeighbors(const Point& p, const unsigned int& k,
+                                    QueryContext& context, double epsilon) const
+{
+    kNearestNodes(p, k, context, epsilon);
+    context.stats.add(context.operation);
+    context.points.clear();
+    typename std::vector<distNodePair>::const_iterator it;
+    for(it=context.nearest.begin();it!=context.nearest.end();++it) {
+        const std::vector<Point>& p = it->second->getPoints();
+        typename std::vector<Point>::const_iterator it2;
+        for(it2=p.begin();it2!=p.end();++it2) context.points.push_back(&*it2);
+        if(context.points.size() >= k) break;
+    }
+    return context.points;
+}
+
+template<class Point, class Base, class Stats>
+std::vector<Point> CoverTree<Point,Base,Stats>::rangeSearch(const Point& p, double r) const
+{
+    std::vector<Point> found;
+    if(_root==NULL) return found;
+    typename Stats::Operation op;
+    op.begin(RANGE_QUERY);
+    std::vector<distNodePair> Q(1,std::make_pair(p.distance(_root->getPoint()),
+                                                 _root));
+    op.distance();
+    for(int level=_maxLevel;level>=_minLevel;level--) {
+        //a node farther than this has no descendant left within r
+        double bound = r + coverRadius(level-1);
+        unsigned int size = Q.size();
+        op.touch(size);
+        for(unsigned int i=0;i<size;i++) {
+            double parentDist = Q[i].first;
+            ChildRange children = Q[i].second->children(level);
+            typename ChildRange::const_iterator it;
+            for(it=children.begin();it!=children.end();++it) {
+                double childBound = std::min(bound, r + (*it)->radius());
+                //as in kNearestNodes
+                if(std::fabs(parentDist-(*it)->parentDistance()) > childBound) {
+                    op.prune(1);
+                    continue;
+                }
+                double d = distance(p, (*it)->getPoint(), childBound);
+                op.distance();
+                if(d <= childBound) Q.push_back(std::make_pair(d,*it));
+                else op.prune(1);
+            }
+        }
+        op.prune(prune(Q, r, coverRadius(level-1)));
+        op.level(Q.size());
+    }
+    prune(Q, r);
+    record(op);
+    std::sort(Q.begin(), Q.end());
+    typename std::vector<distNodePair>::const_iterator it;
+    for(it=Q.begin();it!=Q.end();++it) {
+        const std::vector<Point>& points = it->second->getPoints();
+        found.insert(found.end(),points.begin(),points.end());
+    }
+    return found;
+}
+
+template<class Point, class Base, class Stats>
+std::vector<std::vector<Point> >
+CoverTree<Point,Base,Stats>::kNearestNeighborsBatch(const std::vector<Point>& queries,
+                                         const unsigned int& k,
+                                         unsigned int threads,
+                                         double epsilon) const
+{
+    std::vector<std::vector<Point> > results(queries.size());
+    threads = workerCount(threads, queries.size());
+    std::vector<QueryContext> contexts(threads);
+    parallelFor(queries.size(), threads,
+                [&](unsigned int worker, unsigned int i) {
+                    QueryContext& context = contexts[worker];
+                    kNearestNeighbors(queries[i], k, context, results[i], epsilon);
+                    context.stats.add(context.operation);
+                });
+    for(unsigned int i=0;i<threads;i++) record(contexts[i].stats);
+    return results;
+}
+
+template<class Point, class Base, class Stats>
+std::vector<std::pair<Point, std::vector<Point> > >
+CoverTree<Point,Base,Stats>::kNearestNeighbors(const CoverTree<Point,Base,Stats>& queries,
+                                    const unsigned int& k) const
+{
+    std::vector<std::pair<Point, std::vector<Point> > > results;
+    if(_root==NULL || queries._root==NULL) return results;
+    std::vector<distNodePair> coverSet
+        (1,std::make_pair(queries._root->distance(_root->getPoint()),_root));
+    std::vector<double> scratch;
+    batch_nearest_rec(queries._root, queries._maxLevel, queries,
+                      coverSet, _maxLevel, k, results, scratch);
+    return results;
+}
+
+template<class Point, class Base, class Stats>
+Stats CoverTree<Point,Base,Stats>::operationStats() const
+{
+    return this->recorded();
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::clearOperationStats()
+{
+    this->clearRecorded();
+}
+
+template<class Point, class Base, class Stats>
+double CoverTree<Point,Base,Stats>::coverRadius(int level) const
+{
+    if(level <= _minLevel) return 0.0;
+    return reach(level);
+}
+
+template<class Point, class Base, class Stats>
+constexpr double CoverTree<Point,Base,Stats>::base;
+
+template<class Point, class Base, class Stats>
+const uint32_t CoverTree<Point,Base,Stats>::FILE_MAGIC;
+
+template<class Point, class Base, class Stats>
+const uint32_t CoverTree<Point,Base,Stats>::FILE_VERSION;
+
+template<class Point, class Base, class Stats>
+double CoverTree<Point,Base,Stats>::scale(int level)
+{
+    //C++11 makes the first call build this exactly once, even when
+    //several threads get here at the same time
+    static const std::vector<double> table = []() {
+        std::vector<double> t(2*SCALE_LEVELS+1);
+        for(int i=-SCALE_LEVELS;i<=SCALE_LEVELS;i++) {
+            t[i+SCALE_LEVELS] = pow(base, i);
+        }
+        return t;
+    }();
+    if(level < -SCALE_LEVELS || level > SCALE_LEVELS) return pow(base, level);
+    return table[level+SCALE_LEVELS];
+}
+
+template<class Point, class Base, class Stats>
+double CoverTree<Point,Base,Stats>::kthDistance(const std::vector<distNodePair>& Q,
+                                     const unsigned int& k,
+                                     std::vector<double>& scratch)
+{
+    if(k==0 || Q.size() < k) return DBL_MAX;
+    scratch.clear();
+    typename std::vector<distNodePair>::const_iterator it;
+    for(it=Q.begin();it!=Q.end();++it) scratch.push_back(it->first);
+    std::nth_element(scratch.begin(), scratch.begin()+(k-1), scratch.end());
+    return scratch[k-1];
+}
+
+template<class Point, class Base, class Stats>
+std::size_t CoverTree<Point,Base,Stats>::prune(std::vector<distNodePair>& Q, double bound)
+{
+    unsigned int kept = 0;
+    for(unsigned int i=0;i<Q.size();i++) {
+        if(Q[i].first <= bound) Q[kept++] = Q[i];
+    }
+    std::size_t removed = Q.size()-kept;
+    Q.resize(kept);
+    return removed;
+}
+
+template<class Point, class Base, class Stats>
+std::size_t CoverTree<Point,Base,Stats>::prune(std::vector<distNodePair>& Q, double bound,
+                                   double radius)
+{
+    unsigned int kept = 0;
+    for(unsigned int i=0;i<Q.size();i++) {
+        if(Q[i].first <= bound + std::min(radius, Q[i].second->radius())) {
+            Q[kept++] = Q[i];
+        }
+    }
+    std::size_t removed = Q.size()-kept;
+    Q.resize(kept);
+    return removed;
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::grow(CoverTreeNode* n, double r)
+{
+    for(r*=1+RADIUS_SLACK; n!=NULL && n->radius() < r; n=n->getParent()) {
+        n->setRadius(r);
+        r = (r+n->parentDistance())*(1+RADIUS_SLACK);
+    }
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::computeRadii()
+{
+    if(_root==NULL) return;
+    //breadth first, so children come after their parents
+    std::vector<CoverTreeNode*> nodes(1,_root);
+    for(unsigned int i=0;i<nodes.size();i++) {
+        ChildRange children = nodes[i]->allChildren();
+        nodes.insert(nodes.end(),children.begin(),children.end());
+    }
+    for(unsigned int i=nodes.size();i>0;i--) {
+        CoverTreeNode* n = nodes[i-1];
+        ChildRange children = n->allChildren();
+        double r = 0.0;
+        for(unsigned int j=0;j<children.size();j++) {
+            r = std::max(r, children[j]->parentDistance()+children[j]->radius());
+        }
+        n->setRadius(r*(1+RADIUS_SLACK));
+    }
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::fitRoot()
+{
+    //children are kept highest level first
+    if(_root!=NULL && !_root->allChildren().empty()) {
+        _maxLevel = _root->childLevel(0);
+    }
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::batch_nearest_rec
+(CoverTreeNode* query, int queryLevel,
+ const CoverTree<Point,Base,Stats>& queries,
+ std::vector<distNodePair>& coverSet, int level,
+ const unsigned int& k,
+ std::vector<std::pair<Point, std::vector<Point> > >& results,
+ std::vector<double>& scratch) const
+{
+    //Every point within queryRadius of query has k nodes in coverSet within
+    //kth+queryRadius of it, so a node can be dropped once it is farther
+    //than kth+2*queryRadius+coverRadius(level) from query.
+    const Point& q = query->getPoint();
+    while(level > _minLevel || queryLevel > queries._minLevel) {
+        double queryRadius = queries.coverRadius(queryLevel);
+        if(level > _minLevel &&
+           (level >= queryLevel || queryLevel <= queries._minLevel)) {
+            //this tree has the larger scale, so descend it a level. The kth
+            //distance can only shrink as children are added, so any child
+            //farther than bound would be pruned anyway.
+            double bound = kthDistance(coverSet,k,scratch)
+                + 2*queryRadius + coverRadius(level-1);
+            unsigned int size = coverSet.size();
+            for(unsigned int i=0;i<size;i++) {
+                ChildRange children = coverSet[i].second->children(level);
+                typename ChildRange::const_iterator it;
+                for(it=children.begin();it!=children.end();++it) {
+                    double d = distance(q, (*it)->getPoint(), bound);
+                    if(d <= bound) coverSet.push_back(std::make_pair(d,*it));
+                }
+            }
+            level--;
+            prune(coverSet, kthDistance(coverSet,k,scratch)
+                  + 2*queryRadius + coverRadius(level));
+        } else {
+            //the query subtree has the larger scale, so split off query's
+            //children at queryLevel, each with its own cover set
+            double kth = kthDistance(coverSet,k,scratch);
+            double childRadius = queries.coverRadius(queryLevel-1);
+            double refRadius = coverRadius(level);
+            ChildRange children = query->children(queryLevel);
+            typename ChildRange::const_iterator it;
+            for(it=children.begin();it!=children.end();++it) {
+                const Point& c = (*it)->getPoint();
+                double dist = query->distance(c);
+                //k nodes are within kth+dist of the child
+                double bound = kth + dist + 2*childRadius + refRadius;
+                std::vector<distNodePair> childSet;
+                typename std::vector<distNodePair>::const_iterator it2;
+                for(it2=coverSet.begin();it2!=coverSet.end();++it2) {
+                    //triangle inequality: the child is at least this far
+                    if(fabs(it2->first - dist) > bound) continue;
+                    double d = distance(c, it2->second->getPoint(), bound);
+                    if(d <= bound) childSet.push_back(std::make_pair(d,it2->second));
+                }
+                prune(childSet, kthDistance(childSet,k,scratch)
+                      + 2*childRadius + refRadius);
+                batch_nearest_rec(*it, queryLevel-1, queries, childSet, level,
+                                  k, results, scratch);
+            }
+            queryLevel--;
+            prune(coverSet, kth + 2*childRadius + refRadius);
+        }
+    }
+    //Neither tree can be descended any further, so coverSet now holds the
+    //nearest neighbors of query's points.
+    std::sort(coverSet.begin(), coverSet.end());
+    if(coverSet.size() > k) coverSet.resize(k);
+    std::vector<Point> kNN;
+    typename std::vector<distNodePair>::const_iterator it;
+    for(it=coverSet.begin();it!=coverSet.end();++it) {
+        const std::vector<Point>& p = it->second->getPoints();
         kNN.insert(kNN.end(),p.begin(),p.end());
         if(kNN.size() >= k) break;
     }
-    return kNN;
+    const std::vector<Point>& points = query->getPoints();
+    typename std::vector<Point>::const_iterator it2;
+    for(it2=points.begin();it2!=points.end();++it2) {
+        results.push_back(std::make_pair(*it2, kNN));
+    }
 }
 
-template<class Point>
-void CoverTree<Point>::print() const
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::print() const
 {
     int d = _maxLevel-_minLevel+1;
     std::vector<CoverTreeNode*> Q;
@@ -516,9 +2192,8 @@ void CoverTree<Point>::print() const
         typename std::vector<CoverTreeNode*>::const_iterator it;
         for(it=Q.begin();it!=Q.end();++it) {
             (*it)->getPoint().print();
-            std::vector<CoverTreeNode*>
-                children = (*it)->getChildren(_maxLevel-i);
-            typename std::vector<CoverTreeNode*>::const_iterator it2;
+            ChildRange children = (*it)->children(_maxLevel-i);
+            typename ChildRange::const_iterator it2;
             for(it2=children.begin();it2!=children.end();++it2) {
                 std::cout << "  ";
                 (*it2)->getPoint().print();
@@ -526,8 +2201,7 @@ void CoverTree<Point>::print() const
         }
         std::vector<CoverTreeNode*> newQ;
         for(it=Q.begin();it!=Q.end();++it) {
-            std::vector<CoverTreeNode*>
-                children = (*it)->getChildren(_maxLevel-i);
+            ChildRange children = (*it)->children(_maxLevel-i);
             newQ.insert(newQ.end(),children.begin(),children.end());
         }
         Q.insert(Q.end(),newQ.begin(),newQ.end());
@@ -535,57 +2209,100 @@ void CoverTree<Point>::print() const
     }
 }
 
-template<class Point>
-typename CoverTree<Point>::CoverTreeNode* CoverTree<Point>::getRoot() const
+template<class Point, class Base, class Stats>
+typename CoverTree<Point,Base,Stats>::CoverTreeNode* CoverTree<Point,Base,Stats>::getRoot() const
 {
     return _root;
 }
 
-template<class Point>
-CoverTree<Point>::CoverTreeNode::CoverTreeNode(const Point& p) {
+template<class Point, class Base, class Stats>
+CoverTree<Point,Base,Stats>::CoverTreeNode::CoverTreeNode(const Point& p, unsigned int id)
+    : _id(id), _parent(NULL), _parentDist(0.0), _radius(0.0)
+{
     _points.push_back(p);
 }
 
-template<class Point>
-std::vector<typename CoverTree<Point>::CoverTreeNode*>
-CoverTree<Point>::CoverTreeNode::getChildren(int level) const
+template<class Point, class Base, class Stats>
+typename CoverTree<Point,Base,Stats>::ChildRange
+CoverTree<Point,Base,Stats>::CoverTreeNode::children(int level) const
 {
-    typename std::map<int,std::vector<CoverTreeNode*> >::const_iterator
-        it = _childMap.find(level);
-    if(it!=_childMap.end()) {
-        return it->second;
-    }
-    return std::vector<CoverTreeNode*>();
+    //_childLevels is sorted in descending order
+    std::pair<std::vector<int>::const_iterator,
+              std::vector<int>::const_iterator> range =
+        std::equal_range(_childLevels.begin(), _childLevels.end(),
+                         level, std::greater<int>());
+    typename ChildRange::const_iterator first = _children.data();
+    return ChildRange(first+(range.first-_childLevels.begin()),
+                      first+(range.second-_childLevels.begin()));
 }
 
-template<class Point>
-void CoverTree<Point>::CoverTreeNode::addChild(int level, CoverTreeNode* p)
+template<class Point, class Base, class Stats>
+std::vector<typename CoverTree<Point,Base,Stats>::CoverTreeNode*>
+CoverTree<Point,Base,Stats>::CoverTreeNode::getChildren(int level) const
 {
-    _childMap[level].push_back(p);
+    ChildRange range = children(level);
+    return std::vector<CoverTreeNode*>(range.begin(), range.end());
 }
 
-template<class Point>
-void CoverTree<Point>::CoverTreeNode::removeChild(int level, CoverTreeNode* p)
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::CoverTreeNode::addChild(int level, CoverTreeNode* p,
+                                                double dist)
+{
+    p->_parent = this;
+    p->_parentDist = dist;
+    //append p to the end of the range of children at this level
+    std::vector<int>::iterator it =
+        std::upper_bound(_childLevels.begin(), _childLevels.end(),
+                         level, std::greater<int>());
+    _children.insert(_children.begin()+(it-_childLevels.begin()), p);
+    _childLevels.insert(it, level);
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::CoverTreeNode::removeChild(int level, CoverTreeNode* p)
 {
-    std::vector<CoverTreeNode*>& v = _childMap[level];
-    for(unsigned int i=0;i<v.size();i++) {
-        if(v[i]==p) {
-            v[i]=v.back();
-            v.pop_back();
+    std::pair<std::vector<int>::iterator, std::vector<int>::iterator> range =
+        std::equal_range(_childLevels.begin(), _childLevels.end(),
+                         level, std::greater<int>());
+    unsigned int end = range.second-_childLevels.begin();
+    for(unsigned int i=range.first-_childLevels.begin();i<end;i++) {
+        if(_children[i]==p) {
+            _children.erase(_children.begin()+i);
+            _childLevels.erase(_childLevels.begin()+i);
+            p->_parent = NULL;
+            p->_parentDist = 0.0;
             break;
         }
     }
 }
 
-template<class Point>
-void CoverTree<Point>::CoverTreeNode::addPoint(const Point& p)
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::CoverTreeNode::release()
+{
+    _children.clear();
+    _childLevels.clear();
+    _points.clear();
+    _parent = NULL;
+    _parentDist = 0.0;
+    _radius = 0.0;
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::CoverTreeNode::reset(const Point& p)
+{
+    release();
+    _points.push_back(p);
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::CoverTreeNode::addPoint(const Point& p)
 {
     if(find(_points.begin(), _points.end(), p) == _points.end())
         _points.push_back(p);
 }
 
-template<class Point>
-void CoverTree<Point>::CoverTreeNode::removePoint(const Point& p)
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::CoverTreeNode::removePoint(const Point& p)
 {
     typename std::vector<Point>::iterator it =
         find(_points.begin(), _points.end(), p);
@@ -593,49 +2310,314 @@ void CoverTree<Point>::CoverTreeNode::removePoint(const Point& p)
         _points.erase(it);
 }
 
-template<class Point>
-double CoverTree<Point>::CoverTreeNode::distance(const CoverTreeNode& p) const
+template<class Point, class Base, class Stats>
+double CoverTree<Point,Base,Stats>::CoverTreeNode::distance(const CoverTreeNode& p) const
 {
     return _points[0].distance(p.getPoint());
 }
  
-template<class Point>
-bool CoverTree<Point>::CoverTreeNode::isSingle() const
+template<class Point, class Base, class Stats>
+double CoverTree<Point,Base,Stats>::CoverTreeNode::distance(const Point& p) const
+{
+    return _points[0].distance(p);
+}
+
+template<class Point, class Base, class Stats>
+bool CoverTree<Point,Base,Stats>::CoverTreeNode::isSingle() const
 {
     return _points.size() == 1;
 }
 
-template<class Point>
-bool CoverTree<Point>::CoverTreeNode::hasPoint(const Point& p) const
+template<class Point, class Base, class Stats>
+bool CoverTree<Point,Base,Stats>::CoverTreeNode::hasPoint(const Point& p) const
 {
     return find(_points.begin(), _points.end(), p) != _points.end();
 }
 
-template<class Point>
-const Point& CoverTree<Point>::CoverTreeNode::getPoint() const { return _points[0]; }
+template<class Point, class Base, class Stats>
+const Point& CoverTree<Point,Base,Stats>::CoverTreeNode::getPoint() const { return _points[0]; }
 
-template<class Point>
-std::vector<typename CoverTree<Point>::CoverTreeNode*>
-CoverTree<Point>::CoverTreeNode::getAllChildren() const
+template<class Point, class Base, class Stats>
+typename CoverTree<Point,Base,Stats>::ChildRange
+CoverTree<Point,Base,Stats>::CoverTreeNode::allChildren() const
+{
+    return ChildRange(_children.data(), _children.data()+_children.size());
+}
+
+template<class Point, class Base, class Stats>
+std::vector<typename CoverTree<Point,Base,Stats>::CoverTreeNode*>
+CoverTree<Point,Base,Stats>::CoverTreeNode::getAllChildren() const
+{
+    return _children;
+}
+
+template<class Point, class Base, class Stats>
+std::size_t CoverTree<Point,Base,Stats>::CoverTreeNode::memoryUsage() const
+{
+    return sizeof(CoverTreeNode)
+        + _children.capacity()*sizeof(CoverTreeNode*)
+        + _childLevels.capacity()*sizeof(int)
+        + _points.capacity()*sizeof(Point);
+}
+
+template<class Point, class Base, class Stats>
+CoverTree<Point,Base,Stats>::NodeArena::NodeArena() : _size(0) {}
+
+template<class Point, class Base, class Stats>
+CoverTree<Point,Base,Stats>::NodeArena::~NodeArena()
 {
-    std::vector<CoverTreeNode*> children;
-    typename std::map<int,std::vector<CoverTreeNode*> >::const_iterator it;
-    for(it=_childMap.begin();it!=_childMap.end();++it) {
-        children.insert(children.end(), it->second.begin(), it->second.end());
+    for(unsigned int i=0;i<_size;i++) {
+        at(i)->~CoverTreeNode();
+    }
+    typename std::vector<CoverTreeNode*>::const_iterator it;
+    for(it=_blocks.begin();it!=_blocks.end();++it) {
+        ::operator delete(*it);
     }
-    return children;
 }
 
-template<class Point>
-bool CoverTree<Point>::isValidTree() const {
+template<class Point, class Base, class Stats>
+typename CoverTree<Point,Base,Stats>::CoverTreeNode*
+CoverTree<Point,Base,Stats>::NodeArena::create(const Point& p)
+{
+    if(!_free.empty()) {
+        CoverTreeNode* n = _free.back();
+        _free.pop_back();
+        n->reset(p);
+        return n;
+    }
+    if(_size==_blocks.size()*BLOCK_SIZE) {
+        _blocks.push_back(static_cast<CoverTreeNode*>
+                          (::operator new(BLOCK_SIZE*sizeof(CoverTreeNode))));
+    }
+    CoverTreeNode* n = _blocks.back()+(_size%BLOCK_SIZE);
+    new (n) CoverTreeNode(p, _size);
+    _size++;
+    return n;
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::NodeArena::destroy(CoverTreeNode* n)
+{
+    n->release();
+    _free.push_back(n);
+}
+
+template<class Point, class Base, class Stats>
+typename CoverTree<Point,Base,Stats>::CoverTreeNode*
+CoverTree<Point,Base,Stats>::NodeArena::at(unsigned int id) const
+{
+    return _blocks[id/BLOCK_SIZE]+(id%BLOCK_SIZE);
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::NodeArena::clear()
+{
+    _free.clear();
+    //backwards, so that create() hands out the lowest ids first
+    for(unsigned int i=_size;i>0;i--) {
+        at(i-1)->release();
+        _free.push_back(at(i-1));
+    }
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::clear()
+{
+    _arena.clear();
+    _root=NULL;
+    _numNodes=0;
+    _minLevel=_maxLevel-1;
+}
+
+template<class Point, class Base, class Stats>
+void CoverTree<Point,Base,Stats>::breadthFirst(std::vector<const CoverTreeNode*>& nodes,
+                                         std::vector<uint32_t>& index) const
+{
+    nodes.clear();
+    index.assign(_arena.size(), 0);
+    if(_root!=NULL) nodes.push_back(_root);
+    for(unsigned int i=0;i<nodes.size();i++) {
+        index[nodes[i]->getId()] = i;
+        ChildRange children = nodes[i]->allChildren();
+        nodes.insert(nodes.end(), children.begin(), children.end());
+    }
+}
+
+template<class Point, class Base, class Stats>
+typename CoverTree<Point,Base,Stats>::Statistics CoverTree<Point,Base,Stats>::statistics() const
+{
+    //counts one more of value v in the histogram counts
+    auto add = [](std::vector<unsigned int>& counts, unsigned int v) {
+        if(v >= counts.size()) counts.resize(v+1);
+        counts[v]++;
+    };
+    Statistics s;
+    s.maxLevel = _maxLevel;
+    s.minLevel = _minLevel;
+    s.nodes = _numNodes;
+    s.points = 0;
+    s.levelNodes.assign(_maxLevel-_minLevel+1, 0);
+    s.levelParents.assign(_maxLevel-_minLevel+1, 0);
+    s.bytes = (_arena.size()-_numNodes)*sizeof(CoverTreeNode);
+
+    std::vector<const CoverTreeNode*> nodes;
+    std::vector<uint32_t> index;
+    breadthFirst(nodes, index);
+    //depth, and then height, of each node by its breadth-first number
+    std::vector<unsigned int> depth(nodes.size(), 0), height(nodes.size(), 0);
+    if(!nodes.empty()) s.levelNodes[0]++;
+    for(unsigned int i=0;i<nodes.size();i++) {
+        const CoverTreeNode* n = nodes[i];
+        ChildRange children = n->allChildren();
+        add(s.fanOut, children.size());
+        add(s.depths, depth[i]);
+        add(s.pointsPerNode, n->getPoints().size());
+        s.points += n->getPoints().size();
+        s.bytes += n->memoryUsage();
+        for(unsigned int j=0;j<children.size();j++) {
+            int level = n->childLevel(j);
+            depth[index[children[j]->getId()]] = depth[i]+1;
+            s.levelNodes[_maxLevel-(level-1)]++;
+            if(j==0 || n->childLevel(j-1)!=level) s.levelParents[_maxLevel-level]++;
+        }
+    }
+    //children come after their parents, so this sees them first
+    for(unsigned int i=nodes.size();i>0;i--) {
+        ChildRange children = nodes[i-1]->allChildren();
+        for(unsigned int j=0;j<children.size();j++) {
+            unsigned int h = height[index[children[j]->getId()]]+1;
+            if(h > height[i-1]) height[i-1] = h;
+        }
+        add(s.heights, height[i-1]);
+    }
+    return s;
+}
+
+template<class Point, class Base, class Stats>
+bool CoverTree<Point,Base,Stats>::save(std::ostream& out) const
+{
+    ChecksumBuf buf(out.rdbuf());
+    std::ostream body(&buf);
+    writeValue(body, FILE_MAGIC);
+    writeValue(body, FILE_VERSION);
+    writeValue(body, (int64_t)Base::num);
+    writeValue(body, (int64_t)Base::den);
+    writeValue(body, (int32_t)_maxLevel);
+    writeValue(body, (int32_t)_minLevel);
+    writeValue(body, (uint32_t)_numNodes);
+
+    std::vector<const CoverTreeNode*> nodes;
+    std::vector<uint32_t> index;
+    breadthFirst(nodes, index);
+
+    typename std::vector<const CoverTreeNode*>::const_iterator it;
+    for(it=nodes.begin();it!=nodes.end();++it) {
+        const std::vector<Point>& points = (*it)->getPoints();
+        writeValue(body, (uint32_t)points.size());
+        typename std::vector<Point>::const_iterator p;
+        for(p=points.begin();p!=points.end();++p) p->save(body);
+    }
+    for(it=nodes.begin();it!=nodes.end();++it) {
+        ChildRange children = (*it)->allChildren();
+        writeValue(body, (uint32_t)children.size());
+        for(unsigned int i=0;i<children.size();i++) {
+            writeValue(body, (int32_t)(*it)->childLevel(i));
+            writeValue(body, index[children[i]->getId()]);
+            writeValue(body, children[i]->parentDistance());
+        }
+    }
+    body.flush();
+    if(!body) {
+        out.setstate(std::ios::failbit);
+        return false;
+    }
+    writeValue(out, buf.sum());
+    return (bool)out;
+}
+
+template<class Point, class Base, class Stats>
+bool CoverTree<Point,Base,Stats>::load(std::istream& in)
+{
+    clear();
+    ChecksumBuf buf(in.rdbuf());
+    std::istream body(&buf);
+    uint32_t magic, version, numNodes;
+    int64_t num, den;
+    int32_t maxLevel, minLevel;
+    bool good = readValue(body, magic) && magic==FILE_MAGIC
+        && readValue(body, version) && version==FILE_VERSION
+        && readValue(body, num) && num==Base::num
+        && readValue(body, den) && den==Base::den
+        && readValue(body, maxLevel) && readValue(body, minLevel)
+        && readValue(body, numNodes);
+
+    //nodes are only made as their points arrive, so a corrupt count can't
+    //make this allocate more than the stream actually holds
+    std::vector<CoverTreeNode*> nodes;
+    for(uint32_t i=0;good && i<numNodes;i++) {
+        uint32_t numPoints;
+        good = readValue(body, numPoints) && numPoints > 0;
+        if(!good) break;
+        CoverTreeNode* n = _arena.create(Point::load(body));
+        nodes.push_back(n);
+        for(uint32_t j=1;body && j<numPoints;j++) {
+            n->addPoint(Point::load(body));
+        }
+        good = (bool)body;
+    }
+    //save writes the nodes breadth first, so each child comes after its
+    //parent; with that and one parent per node, the links can only make a
+    //tree rooted at node 0, never a cycle or a node shared by two parents
+    std::vector<bool> attached(nodes.size(), false);
+    for(uint32_t i=0;good && i<numNodes;i++) {
+        uint32_t numChildren;
+        good = (bool)readValue(body, numChildren);
+        for(uint32_t j=0;good && j<numChildren;j++) {
+            int32_t level;
+            uint32_t child;
+            double dist;
+            good = readValue(body, level) && readValue(body, child)
+                && child > i && child < numNodes && !attached[child]
+                && readValue(body, dist) && dist >= 0.0;
+            if(good) {
+                attached[child] = true;
+                nodes[i]->addChild(level, nodes[child], dist);
+            }
+        }
+    }
+    for(uint32_t i=1;good && i<numNodes;i++) good = attached[i];
+    uint64_t sum;
+    good = good && readValue(in, sum) && sum==buf.sum();
+    if(!good) {
+        clear();
+        in.setstate(std::ios::failbit);
+        return false;
+    }
+    _root = nodes.empty() ? NULL : nodes[0];
+    _numNodes = numNodes;
+    _maxLevel = maxLevel;
+    _minLevel = minLevel;
+    computeRadii();
+    fitRoot();
+    return true;
+}
+
+template<class Point, class Base, class Stats>
+bool CoverTree<Point,Base,Stats>::isValidTree() const {
     if(_numNodes==0)
         return _root==NULL;
 
+    //children above _maxLevel would be missed by every descent
+    if(!_root->allChildren().empty() && _root->childLevel(0) > _maxLevel) {
+        std::cout << "Root has children above the top level.\n";
+        return false;
+    }
     std::vector<CoverTreeNode*> nodes;
     nodes.push_back(_root);
     for(int i=_maxLevel;i>_minLevel;i--) {
-        double sep = pow(base,i);
+        double sep = scale(i);
         typename std::vector<CoverTreeNode*>::const_iterator it, it2;
+        typename ChildRange::const_iterator it3;
         //verify separation invariant of cover tree: for each level,
         //every point is farther than base^level away
         for(it=nodes.begin(); it!=nodes.end(); ++it) {
@@ -649,15 +2631,22 @@ bool CoverTree<Point>::isValidTree() const {
         }
         std::vector<CoverTreeNode*> allChildren;
         for(it=nodes.begin(); it!=nodes.end(); ++it) {        
-            std::vector<CoverTreeNode*> children = (*it)->getChildren(i);
+            ChildRange children = (*it)->children(i);
             //verify covering tree invariant: the children of node n at level
             //i are no further than base^i away
-            for(it2=children.begin(); it2!=children.end(); ++it2) {
-                double dist = (*it2)->distance((*it)->getPoint());
+            for(it3=children.begin(); it3!=children.end(); ++it3) {
+                double dist = (*it3)->distance((*it)->getPoint());
                 if(dist>sep) {
                     std::cout << "Level" << i << " covering tree invariant failed.n";
                     return false;
                 }
+                //and the cached distances and radii agree with the tree
+                double cached = (*it3)->parentDistance();
+                if((*it3)->getParent()!=*it || std::fabs(cached-dist) > 1e-9*(1+dist)
+                   || (*it)->radius() < cached+(*it3)->radius()) {
+                    std::cout << "Level " << i << " cached distances are wrong.\n";
+                    return false;
+                }
             }
             allChildren.insert
                 (allChildren.end(),children.begin(),children.end());
@@ -0,0 +1,269 @@
+#ifndef _COVER_TREE_CONCURRENT_H
+#define _COVER_TREE_CONCURRENT_H
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "Cover_Tree.h"
+
+/**
+ * Counts the readers inside one version of a ConcurrentCoverTree. Readers
+ * are spread over several cache-line sized counters by thread so they do
+ * not all fight over the same line.
+ */
+class ReadIndicator
+{
+    struct alignas(64) Counter
+    {
+        std::atomic<long> count;
+        Counter() : count(0) {}
+    };
+    static const unsigned int STRIPES = 16;
+    Counter _counters[STRIPES];
+
+    Counter& mine()
+    {
+        return _counters[std::hash<std::thread::id>()
+                         (std::this_thread::get_id()) % STRIPES];
+    }
+ public:
+    void arrive() { mine().count.fetch_add(1); }
+    void depart() { mine().count.fetch_sub(1); }
+
+    /**
+     * True iff no reader is between arrive() and depart().
+     */
+    bool empty() const
+    {
+        for(unsigned int i=0;i<STRIPES;i++) {
+            if(_counters[i].count.load() != 0) return false;
+        }
+        return true;
+    }
+}; // ReadIndicator class
+
+/**
+ * A cover tree that any number of threads can query while one thread at a
+ * time inserts and removes points, without queries ever waiting on a write.
+ *
+ * It keeps two identical CoverTrees (the Left-Right technique). Readers use
+ * whichever one is current. A write is applied to the other one, which is
+ * then made current; once every reader that might still be inside the old
+ * one has left it, the write is applied there too. Nodes removed by a write
+ * are therefore only freed once no reader can reach them, much as with
+ * epoch based reclamation, and every query sees the tree as it was between
+ * two writes.
+ *
+ * The price is twice the memory of a single CoverTree, and every write is
+ * done twice (writers also wait for slow readers to leave). Point must be
+ * safe to copy and compare from several threads at once.
+ *
+ * Point and Base are as for CoverTree.
+ */
+template<class Point, class Base = std::ratio<2> >
+class ConcurrentCoverTree
+{
+ private:
+    CoverTree<Point,Base> _left, _right;
+    std::atomic<int> _current;//which tree readers use: 0 _left, 1 _right
+    mutable ReadIndicator _readers[2];
+    std::atomic<int> _version;//which of _readers new readers arrive at
+    mutable std::mutex _writeLock;
+
+    CoverTree<Point,Base>& tree(int i) { return i==0 ? _left : _right; }
+    const CoverTree<Point,Base>& tree(int i) const { return i==0 ? _left : _right; }
+
+    /**
+     * Makes new readers arrive at the other read indicator, then waits until
+     * both are empty, i.e. until every reader which might have seen the
+     * previous _current has finished.
+     */
+    void waitForReaders();
+
+    /**
+     * Applies change to both trees as described above.
+     */
+    void write(const std::function<void(CoverTree<Point,Base>&)>& change);
+
+ public:
+    /**
+     * Same as the CoverTree constructors; both copies start out with points.
+     */
+    explicit ConcurrentCoverTree(const std::vector<Point>& points=std::vector<Point>(),
+                                 unsigned int threads = 1);
+    ConcurrentCoverTree(const double& maxDist,
+                        const std::vector<Point>& points=std::vector<Point>(),
+                        unsigned int threads = 1);
+
+    ConcurrentCoverTree(const ConcurrentCoverTree&) = delete;
+    ConcurrentCoverTree& operator=(const ConcurrentCoverTree&) = delete;
+
+    /**
+     * Calls f with the current tree and returns what it returns. The tree
+     * will not change while f runs, so f can make several queries against
+     * one consistent version. f must not modify the tree.
+     */
+    template<class F>
+    auto read(F f) const -> decltype(f(std::declval<const CoverTree<Point,Base>&>()));
+
+    /**
+     * Same as CoverTree::insert. Waits for any other write to finish.
+     */
+    void insert(const Point& newPoint);
+
+    /**
+     * Same as CoverTree::remove. Waits for any other write to finish.
+     */
+    void remove(const Point& p);
+
+    /**
+     * Same as CoverTree::clear. Waits for any other write to finish.
+     */
+    void clear();
+
+    /**
+     * Same as CoverTree::kNearestNeighbors, on the current version.
+     */
+    std::vector<Point> kNearestNeighbors(const Point& p,
+                                         const unsigned int& k,
+                                         double epsilon = 0.0) const;
+
+    /**
+     * Same as CoverTree::rangeSearch, on the current version.
+     */
+    std::vector<Point> rangeSearch(const Point& p, double r) const;
+
+    /**
+     * Same as CoverTree::kNearestNeighborsBatch, with every query answered
+     * from the same version.
+     */
+    std::vector<std::vector<Point> >
+        kNearestNeighborsBatch(const std::vector<Point>& queries,
+                               const unsigned int& k,
+                               unsigned int threads = 0,
+                               double epsilon = 0.0) const;
+
+    /**
+     * Just for testing/debugging. True iff both copies are valid. Waits for
+     * any write to finish.
+     */
+    bool isValidTree() const;
+}; // ConcurrentCoverTree class
+
+template<class Point, class Base>
+ConcurrentCoverTree<Point,Base>::ConcurrentCoverTree(const std::vector<Point>& points,
+                                                unsigned int threads)
+    : _left(points, threads), _right(points, threads),
+      _current(0), _version(0)
+{
+}
+
+template<class Point, class Base>
+ConcurrentCoverTree<Point,Base>::ConcurrentCoverTree(const double& maxDist,
+                                                const std::vector<Point>& points,
+                                                unsigned int threads)
+    : _left(maxDist, points, threads), _right(maxDist, points, threads),
+      _current(0), _version(0)
+{
+}
+
+template<class Point, class Base>
+template<class F>
+auto ConcurrentCoverTree<Point,Base>::read(F f) const
+    -> decltype(f(std::declval<const CoverTree<Point,Base>&>()))
+{
+    struct Departure
+    {
+        ReadIndicator& readers;
+        ~Departure() { readers.depart(); }
+    };
+    ReadIndicator& readers = _readers[_version.load()];
+    readers.arrive();
+    Departure departure = {readers};
+    return f(tree(_current.load()));
+}
+
+template<class Point, class Base>
+void ConcurrentCoverTree<Point,Base>::waitForReaders()
+{
+    int previous = _version.load();
+    int next = 1 - previous;
+    //a reader may still be leaving next from the toggle before last
+    while(!_readers[next].empty()) std::this_thread::yield();
+    _version.store(next);
+    while(!_readers[previous].empty()) std::this_thread::yield();
+}
+
+template<class Point, class Base>
+void ConcurrentCoverTree<Point,Base>::write(const std::function<void(CoverTree<Point,Base>&)>& change)
+{
+    std::lock_guard<std::mutex> guard(_writeLock);
+    int current = _current.load();
+    change(tree(1-current));
+    _current.store(1-current);
+    waitForReaders();
+    change(tree(current));
+}
+
+template<class Point, class Base>
+void ConcurrentCoverTree<Point,Base>::insert(const Point& newPoint)
+{
+    write([&](CoverTree<Point,Base>& t) { t.insert(newPoint); });
+}
+
+template<class Point, class Base>
+void ConcurrentCoverTree<Point,Base>::remove(const Point& p)
+{
+    write([&](CoverTree<Point,Base>& t) { t.remove(p); });
+}
+
+template<class Point, class Base>
+void ConcurrentCoverTree<Point,Base>::clear()
+{
+    write([](CoverTree<Point,Base>& t) { t.clear(); });
+}
+
+template<class Point, class Base>
+std::vector<Point>
+ConcurrentCoverTree<Point,Base>::kNearestNeighbors(const Point& p,
+                                              const unsigned int& k,
+                                              double epsilon) const
+{
+    return read([&](const CoverTree<Point,Base>& t) {
+        return t.kNearestNeighbors(p, k, epsilon);
+    });
+}
+
+template<class Point, class Base>
+std::vector<Point>
+ConcurrentCoverTree<Point,Base>::rangeSearch(const Point& p, double r) const
+{
+    return read([&](const CoverTree<Point,Base>& t) {
+        return t.rangeSearch(p, r);
+    });
+}
+
+template<class Point, class Base>
+std::vector<std::vector<Point> >
+ConcurrentCoverTree<Point,Base>::kNearestNeighborsBatch(const std::vector<Point>& queries,
+                                                   const unsigned int& k,
+                                                   unsigned int threads,
+                                                   double epsilon) const
+{
+    return read([&](const CoverTree<Point,Base>& t) {
+        return t.kNearestNeighborsBatch(queries, k, threads, epsilon);
+    });
+}
+
+template<class Point, class Base>
+bool ConcurrentCoverTree<Point,Base>::isValidTree() const
+{
+    std::lock_guard<std::mutex> guard(_writeLock);
+    return _left.isValidTree() && _right.isValidTree();
+}
+
+#endif // _COVER_TREE_CONCURRENT_H
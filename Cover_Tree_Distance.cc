@@ -0,0 +1,293 @@
+#include "Cover_Tree_Distance.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COVER_TREE_X86 1
+#endif
+
+using namespace std;
+
+// How many coordinates the kernels add up between checks against the bound
+// (see the batch constant in langford/point.cc). Must be a multiple of 16.
+static const unsigned int CHUNK = 32;
+
+// Kept scalar even under -O3 so it is an honest baseline for the others.
+template<class T>
+__attribute__((optimize("no-tree-vectorize")))
+static T squaredDistanceScalar(const T* a, const T* b, unsigned int n, T boundSq) {
+    T sum = 0;
+    unsigned int i = 0;
+    for (; i + CHUNK <= n; i += CHUNK) {
+        for (unsigned int j = i; j < i + CHUNK; j++) {
+            T d = a[j] - b[j];
+            sum += d*d;
+        }
+        if (sum > boundSq) {
+            return sum;
+        }
+    }
+    for (; i < n; i++) {
+        T d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+static double scalarDouble(const double* a, const double* b, unsigned int n, double boundSq) {
+    return squaredDistanceScalar(a, b, n, boundSq);
+}
+
+static float scalarFloat(const float* a, const float* b, unsigned int n, float boundSq) {
+    return squaredDistanceScalar(a, b, n, boundSq);
+}
+
+#ifdef COVER_TREE_X86
+
+__attribute__((target("sse2")))
+static double sumSSE2(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+__attribute__((target("sse2")))
+static float sumSSE2(__m128 v) {
+    __m128 h = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    return _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+}
+
+__attribute__((target("sse2")))
+static double sse2Double(const double* a, const double* b, unsigned int n, double boundSq) {
+    __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+    unsigned int i = 0;
+    for (; i + CHUNK <= n; i += CHUNK) {
+        for (unsigned int j = i; j < i + CHUNK; j += 4) {
+            __m128d d0 = _mm_sub_pd(_mm_loadu_pd(a+j), _mm_loadu_pd(b+j));
+            __m128d d1 = _mm_sub_pd(_mm_loadu_pd(a+j+2), _mm_loadu_pd(b+j+2));
+            s0 = _mm_add_pd(s0, _mm_mul_pd(d0, d0));
+            s1 = _mm_add_pd(s1, _mm_mul_pd(d1, d1));
+        }
+        double sum = sumSSE2(_mm_add_pd(s0, s1));
+        if (sum > boundSq) {
+            return sum;
+        }
+    }
+    for (; i + 2 <= n; i += 2) {
+        __m128d d = _mm_sub_pd(_mm_loadu_pd(a+i), _mm_loadu_pd(b+i));
+        s0 = _mm_add_pd(s0, _mm_mul_pd(d, d));
+    }
+    double sum = sumSSE2(_mm_add_pd(s0, s1));
+    for (; i < n; i++) {
+        double d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+__attribute__((target("sse2")))
+static float sse2Float(const float* a, const float* b, unsigned int n, float boundSq) {
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    unsigned int i = 0;
+    for (; i + CHUNK <= n; i += CHUNK) {
+        for (unsigned int j = i; j < i + CHUNK; j += 8) {
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a+j), _mm_loadu_ps(b+j));
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a+j+4), _mm_loadu_ps(b+j+4));
+            s0 = _mm_add_ps(s0, _mm_mul_ps(d0, d0));
+            s1 = _mm_add_ps(s1, _mm_mul_ps(d1, d1));
+        }
+        float sum = sumSSE2(_mm_add_ps(s0, s1));
+        if (sum > boundSq) {
+            return sum;
+        }
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i));
+        s0 = _mm_add_ps(s0, _mm_mul_ps(d, d));
+    }
+    float sum = sumSSE2(_mm_add_ps(s0, s1));
+    for (; i < n; i++) {
+        float d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static double sumAVX2(__m256d v) {
+    __m128d h = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(h, _mm_unpackhi_pd(h, h)));
+}
+
+__attribute__((target("avx2,fma")))
+static float sumAVX2(__m256 v) {
+    __m128 h = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    h = _mm_add_ps(h, _mm_movehl_ps(h, h));
+    return _mm_cvtss_f32(_mm_add_ss(h, _mm_shuffle_ps(h, h, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+static double avx2Double(const double* a, const double* b, unsigned int n, double boundSq) {
+    __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+    unsigned int i = 0;
+    for (; i + CHUNK <= n; i += CHUNK) {
+        for (unsigned int j = i; j < i + CHUNK; j += 8) {
+            __m256d d0 = _mm256_sub_pd(_mm256_loadu_pd(a+j), _mm256_loadu_pd(b+j));
+            __m256d d1 = _mm256_sub_pd(_mm256_loadu_pd(a+j+4), _mm256_loadu_pd(b+j+4));
+            s0 = _mm256_fmadd_pd(d0, d0, s0);
+            s1 = _mm256_fmadd_pd(d1, d1, s1);
+        }
+        double sum = sumAVX2(_mm256_add_pd(s0, s1));
+        if (sum > boundSq) {
+            return sum;
+        }
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(a+i), _mm256_loadu_pd(b+i));
+        s0 = _mm256_fmadd_pd(d, d, s0);
+    }
+    double sum = sumAVX2(_mm256_add_pd(s0, s1));
+    for (; i < n; i++) {
+        double d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float avx2Float(const float* a, const float* b, unsigned int n, float boundSq) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    unsigned int i = 0;
+    for (; i + CHUNK <= n; i += CHUNK) {
+        for (unsigned int j = i; j < i + CHUNK; j += 16) {
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a+j), _mm256_loadu_ps(b+j));
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a+j+8), _mm256_loadu_ps(b+j+8));
+            s0 = _mm256_fmadd_ps(d0, d0, s0);
+            s1 = _mm256_fmadd_ps(d1, d1, s1);
+        }
+        float sum = sumAVX2(_mm256_add_ps(s0, s1));
+        if (sum > boundSq) {
+            return sum;
+        }
+    }
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i));
+        s0 = _mm256_fmadd_ps(d, d, s0);
+    }
+    float sum = sumAVX2(_mm256_add_ps(s0, s1));
+    for (; i < n; i++) {
+        float d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sum;
+}
+
+// The zero-masked extract sidesteps a spurious -Wmaybe-uninitialized from
+// GCC 12's headers for the plain one.
+__attribute__((target("avx512f")))
+static double sumAVX512(__m512d v) {
+    return sumAVX2(_mm256_add_pd(_mm512_maskz_extractf64x4_pd(0xF, v, 0),
+                                 _mm512_maskz_extractf64x4_pd(0xF, v, 1)));
+}
+
+__attribute__((target("avx512f")))
+static float sumAVX512(__m512 v) {
+    __m512d d = _mm512_castps_pd(v);
+    return sumAVX2(_mm256_add_ps(_mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, d, 0)),
+                                 _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, d, 1))));
+}
+
+__attribute__((target("avx512f")))
+static double avx512Double(const double* a, const double* b, unsigned int n, double boundSq) {
+    __m512d s0 = _mm512_setzero_pd(), s1 = _mm512_setzero_pd();
+    unsigned int i = 0;
+    for (; i + CHUNK <= n; i += CHUNK) {
+        for (unsigned int j = i; j < i + CHUNK; j += 16) {
+            __m512d d0 = _mm512_sub_pd(_mm512_loadu_pd(a+j), _mm512_loadu_pd(b+j));
+            __m512d d1 = _mm512_sub_pd(_mm512_loadu_pd(a+j+8), _mm512_loadu_pd(b+j+8));
+            s0 = _mm512_fmadd_pd(d0, d0, s0);
+            s1 = _mm512_fmadd_pd(d1, d1, s1);
+        }
+        double sum = sumAVX512(_mm512_add_pd(s0, s1));
+        if (sum > boundSq) {
+            return sum;
+        }
+    }
+    // the last partial chunk, 8 coordinates at a time with a masked tail
+    for (; i < n; i += 8) {
+        __mmask8 m = n - i >= 8 ? 0xFF : (__mmask8)((1u << (n - i)) - 1);
+        __m512d d = _mm512_sub_pd(_mm512_maskz_loadu_pd(m, a+i),
+                                  _mm512_maskz_loadu_pd(m, b+i));
+        s0 = _mm512_fmadd_pd(d, d, s0);
+    }
+    return sumAVX512(_mm512_add_pd(s0, s1));
+}
+
+__attribute__((target("avx512f")))
+static float avx512Float(const float* a, const float* b, unsigned int n, float boundSq) {
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    unsigned int i = 0;
+    for (; i + CHUNK <= n; i += CHUNK) {
+        // CHUNK is one pair of 16-float registers
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i));
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a+i+16), _mm512_loadu_ps(b+i+16));
+        s0 = _mm512_fmadd_ps(d0, d0, s0);
+        s1 = _mm512_fmadd_ps(d1, d1, s1);
+        float sum = sumAVX512(_mm512_add_ps(s0, s1));
+        if (sum > boundSq) {
+            return sum;
+        }
+    }
+    for (; i < n; i += 16) {
+        __mmask16 m = n - i >= 16 ? 0xFFFF : (__mmask16)((1u << (n - i)) - 1);
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a+i),
+                                 _mm512_maskz_loadu_ps(m, b+i));
+        s0 = _mm512_fmadd_ps(d, d, s0);
+    }
+    return sumAVX512(_mm512_add_ps(s0, s1));
+}
+
+#endif // COVER_TREE_X86
+
+vector<DistanceKernel> supportedDistanceKernels() {
+    vector<DistanceKernel> kernels;
+    DistanceKernel scalar = {"scalar", scalarDouble, scalarFloat};
+    kernels.push_back(scalar);
+#ifdef COVER_TREE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        DistanceKernel k = {"sse2", sse2Double, sse2Float};
+        kernels.push_back(k);
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        DistanceKernel k = {"avx2", avx2Double, avx2Float};
+        kernels.push_back(k);
+    }
+    if (__builtin_cpu_supports("avx512f")) {
+        DistanceKernel k = {"avx512", avx512Double, avx512Float};
+        kernels.push_back(k);
+    }
+#endif
+    return kernels;
+}
+
+// AVX-512 is only used when asked for: on many CPUs the clock slows down
+// while it runs, and it was several times slower than AVX2 at every dimension
+// on the machine this was tuned on (run bench_distance to check yours).
+static DistanceKernel chooseDistanceKernel() {
+    vector<DistanceKernel> kernels = supportedDistanceKernels();
+    const char* wanted = getenv("COVER_TREE_DISTANCE_KERNEL");
+    for (unsigned int i = 0; wanted && i < kernels.size(); i++) {
+        if (strcmp(kernels[i].name, wanted) == 0) {
+            return kernels[i];
+        }
+    }
+    if (strcmp(kernels.back().name, "avx512") == 0) {
+        kernels.pop_back();
+    }
+    return kernels.back();
+}
+
+const DistanceKernel& distanceKernel() {
+    static const DistanceKernel best = chooseDistanceKernel();
+    return best;
+}
@@ -0,0 +1,77 @@
+#ifndef _COVER_TREE_DISTANCE_H
+#define _COVER_TREE_DISTANCE_H
+
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+#include <new>
+
+/**
+ * Euclidean distance kernels for contiguous float and double coordinates.
+ * There is a scalar version plus SSE2, AVX2 and AVX-512 versions where the
+ * compiler and CPU support them. The first time a kernel is needed the best
+ * one the CPU can run is picked, or the one named by the environment
+ * variable COVER_TREE_DISTANCE_KERNEL ("scalar", "sse2", "avx2", "avx512").
+ *
+ * Every kernel returns the sum of squared differences of the first n
+ * coordinates of a and b. They add up the coordinates in chunks and stop
+ * as soon as the running sum exceeds boundSq, in which case they return that
+ * partial sum (which is still greater than boundSq).
+ */
+struct DistanceKernel
+{
+    const char* name;
+    double (*squaredDistance)(const double* a, const double* b,
+                              unsigned int n, double boundSq);
+    float (*squaredDistanceFloat)(const float* a, const float* b,
+                                  unsigned int n, float boundSq);
+};
+
+// Every kernel this CPU can run, slowest first. The first is always scalar.
+std::vector<DistanceKernel> supportedDistanceKernels();
+
+// The kernel used by squaredDistance.
+const DistanceKernel& distanceKernel();
+
+inline double squaredDistance(const double* a, const double* b,
+                              unsigned int n, double boundSq = HUGE_VAL)
+{
+    return distanceKernel().squaredDistance(a, b, n, boundSq);
+}
+
+inline float squaredDistance(const float* a, const float* b,
+                             unsigned int n, float boundSq = HUGE_VALF)
+{
+    return distanceKernel().squaredDistanceFloat(a, b, n, boundSq);
+}
+
+/**
+ * Allocator which aligns every allocation to Align bytes (one cache line
+ * and one AVX-512 register by default), for coordinate storage.
+ */
+template<class T, unsigned int Align = 64>
+class AlignedAllocator
+{
+public:
+    typedef T value_type;
+    template<class U> struct rebind { typedef AlignedAllocator<U, Align> other; };
+
+    AlignedAllocator() {}
+    template<class U>
+    AlignedAllocator(const AlignedAllocator<U, Align>&) {}
+
+    T* allocate(std::size_t n)
+    {
+        void* p = NULL;
+        if(posix_memalign(&p, Align, n*sizeof(T)) != 0) throw std::bad_alloc();
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, std::size_t) { free(p); }
+
+    template<class U>
+    bool operator==(const AlignedAllocator<U, Align>&) const { return true; }
+    template<class U>
+    bool operator!=(const AlignedAllocator<U, Align>&) const { return false; }
+};
+
+#endif // _COVER_TREE_DISTANCE_H
@@ -0,0 +1,185 @@
+#include "Cover_Tree_Loader.h"
+#include "Cover_Tree_Parallel.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Pieces of a file smaller than this aren't worth a thread of their own.
+static const size_t MIN_PIECE = 1 << 16;
+
+// Every power of ten a double holds exactly.
+static const double EXACT_POWERS[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Parses the number starting at p (which must be before end), setting
+// value and returning the end of the number, or returns NULL if no number
+// starts at p. Numbers whose digits fit in 53 bits and whose power of ten
+// is exact are converted with one multiplication or division, which rounds
+// them correctly (Clinger's fast path); anything else goes to strtod.
+static const char* parseNumber(const char* p, const char* end, double& value) {
+    const char* start = p;
+    bool negative = false;
+    if (*p == '-' || *p == '+') {
+        negative = *p == '-';
+        p++;
+    }
+    uint64_t mantissa = 0;
+    int digits = 0;      // significant digits kept in mantissa
+    int exponent = 0;    // power of ten to scale mantissa by
+    bool any = false;    // whether any digit was seen at all
+    bool exact = true;   // whether mantissa holds every significant digit
+    for (; p < end && isDigit(*p); p++) {
+        any = true;
+        if (digits < 19) {
+            mantissa = mantissa*10 + (*p - '0');
+            if (mantissa != 0) digits++;
+        } else {
+            exponent++;
+            if (*p != '0') exact = false;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (p++; p < end && isDigit(*p); p++) {
+            any = true;
+            if (digits < 19) {
+                mantissa = mantissa*10 + (*p - '0');
+                if (mantissa != 0) digits++;
+                exponent--;
+            } else if (*p != '0') {
+                exact = false;
+            }
+        }
+    }
+    if (!any) return NULL;
+    // An exponent only counts if it has digits; otherwise the 'e' is just
+    // a separator.
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool negativeExp = false;
+        if (q < end && (*q == '-' || *q == '+')) {
+            negativeExp = *q == '-';
+            q++;
+        }
+        if (q < end && isDigit(*q)) {
+            int e = 0;
+            for (; q < end && isDigit(*q); q++) {
+                if (e < 100000) e = e*10 + (*q - '0');
+            }
+            exponent += negativeExp ? -e : e;
+            p = q;
+        }
+    }
+    if (exact && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        double v = (double)mantissa;
+        if (exponent < 0) v /= EXACT_POWERS[-exponent];
+        else v *= EXACT_POWERS[exponent];
+        value = negative ? -v : v;
+        return p;
+    }
+    string token(start, p);
+    value = strtod(token.c_str(), NULL);
+    return p;
+}
+
+void parsePoints(const char* begin, const char* end, PointRows& rows) {
+    const char* p = begin;
+    while (p < end) {
+        if (*p == '#') {
+            const char* newline = (const char*)memchr(p, '\n', end - p);
+            p = newline ? newline + 1 : end;
+            continue;
+        }
+        size_t before = rows.values.size();
+        while (p < end && *p != '\n') {
+            char c = *p;
+            if (isDigit(c) || c == '-' || c == '+' || c == '.') {
+                double d;
+                const char* next = parseNumber(p, end, d);
+                if (next) {
+                    rows.values.push_back(d);
+                    p = next;
+                    continue;
+                }
+            }
+            p++;
+        }
+        if (rows.values.size() > before) rows.starts.push_back(rows.values.size());
+        p++;
+    }
+}
+
+bool loadPointFile(const string& path, PointRows& rows, unsigned int threads) {
+    rows.clear();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    if (size == 0) {
+        close(fd);
+        return true;
+    }
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return false;
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    const char* data = (const char*)mapped;
+    const char* end = data + size;
+
+    // Cut the file into a few pieces per thread, each ending at a line
+    // break, so threads which get through theirs early can take more.
+    threads = workerCount(threads, size / MIN_PIECE + 1);
+    size_t pieces = threads == 1 ? 1 : threads * 4;
+    vector<const char*> cuts(1, data);
+    for (size_t i = 1; i < pieces; i++) {
+        const char* cut = data + size / pieces * i;
+        if (cut < cuts.back()) continue;
+        const char* newline = (const char*)memchr(cut, '\n', end - cut);
+        if (!newline) break;
+        cuts.push_back(newline + 1);
+    }
+    cuts.push_back(end);
+
+    vector<PointRows> parsed(cuts.size() - 1);
+    parallelFor(parsed.size(), threads, [&](unsigned int, size_t i) {
+        parsePoints(cuts[i], cuts[i+1], parsed[i]);
+    });
+    munmap(mapped, size);
+
+    if (parsed.size() == 1) {
+        swap(rows, parsed[0]);
+        return true;
+    }
+    size_t values = 0, points = 0;
+    for (size_t i = 0; i < parsed.size(); i++) {
+        values += parsed[i].values.size();
+        points += parsed[i].size();
+    }
+    rows.values.reserve(values);
+    rows.starts.reserve(points + 1);
+    for (size_t i = 0; i < parsed.size(); i++) {
+        size_t offset = rows.values.size();
+        rows.values.insert(rows.values.end(), parsed[i].values.begin(),
+                           parsed[i].values.end());
+        for (size_t j = 1; j < parsed[i].starts.size(); j++) {
+            rows.starts.push_back(offset + parsed[i].starts[j]);
+        }
+    }
+    return true;
+}
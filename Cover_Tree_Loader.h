@@ -0,0 +1,49 @@
+#ifndef _COVER_TREE_LOADER_H
+#define _COVER_TREE_LOADER_H
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+/**
+ * The points of a text file, one row of numbers per point, stored end to
+ * end in one array rather than one allocation per point.
+ */
+struct PointRows
+{
+    std::vector<double> values;
+    // Row i is values[starts[i]] up to values[starts[i+1]]; starts always
+    // ends with values.size().
+    std::vector<std::size_t> starts;
+
+    PointRows() : starts(1, 0) {}
+    std::size_t size() const { return starts.size() - 1; }
+    const double* row(std::size_t i) const { return values.data() + starts[i]; }
+    std::size_t rowSize(std::size_t i) const { return starts[i+1] - starts[i]; }
+    void clear() { values.clear(); starts.assign(1, 0); }
+};
+
+/**
+ * Reads a file of points such as the .point files written by gen_data.py:
+ *  - one point per line, its coordinates in order
+ *  - numbers (integer or floating-point, with an optional exponent) may be
+ *    separated by anything which can't be part of a number
+ *  - lines beginning with "#", and lines with no numbers, are skipped
+ *
+ * The file is memory-mapped and split into that many pieces at line
+ * breaks, which are parsed on threads threads (0 means one per hardware
+ * thread) straight out of the mapping. Numbers are converted exactly as
+ * strtod would, without its cost for the common short ones.
+ *
+ * Returns false, leaving rows empty, if the file can't be read.
+ */
+bool loadPointFile(const std::string& path, PointRows& rows,
+                   unsigned int threads = 1);
+
+/**
+ * Parses the text from begin to end the way loadPointFile parses a file,
+ * appending its points to rows.
+ */
+void parsePoints(const char* begin, const char* end, PointRows& rows);
+
+#endif // _COVER_TREE_LOADER_H
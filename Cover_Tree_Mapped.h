@@ -0,0 +1,505 @@
+#ifndef _COVER_TREE_MAPPED_H
+#define _COVER_TREE_MAPPED_H
+
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <utility>
+#include <string>
+#include <cmath>
+#include <float.h>
+#include <ratio>
+#include <ostream>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Cover_Tree.h"
+#include "Cover_Tree_Distance.h"
+#include "Cover_Tree_Serial.h"
+
+/**
+ * A frozen cover tree of euclidean points, queried straight out of a file
+ * mapped into memory. Opening one reads nothing but its header, so startup
+ * takes no time however large the tree is, and every process which maps
+ * the same file shares one copy of it in the page cache.
+ *
+ * The file is written from a CoverTree by write. Its layout holds no
+ * pointers, only indices, so it can be mapped at any address:
+ *
+ *   Header      (64 bytes)
+ *   MappedNode  numNodes of them, breadth first from the root at 0
+ *   MappedChild numChildren of them; a node's children are a contiguous
+ *               run sorted by level, highest first, as in CoverTreeNode
+ *   labels      numPoints bytes, padded to a multiple of 64
+ *   coordinates numPoints rows of dimension doubles, 64-byte aligned
+ *
+ * The points of a node are a contiguous run of rows, the first of which is
+ * the point the node stands for. Numbers are in the byte order of the
+ * machine which wrote the file.
+ *
+ * Base must match the base of the tree which was written.
+ */
+template<class Base = std::ratio<2> >
+class MappedCoverTree
+{
+public:
+    /**
+     * The distance from a query to a point, and the index of the point.
+     */
+    typedef std::pair<double, uint32_t> Neighbor;
+private:
+    struct Header
+    {
+        uint32_t magic;
+        uint32_t version;
+        int64_t num;
+        int64_t den;
+        int32_t maxLevel;
+        int32_t minLevel;
+        uint32_t numNodes;
+        uint32_t numChildren;
+        uint32_t numPoints;
+        uint32_t dimension;
+        uint64_t checksum;//of everything after the header
+        uint64_t reserved;
+    };
+
+    struct MappedNode
+    {
+        uint32_t firstPoint;
+        uint32_t numPoints;
+        uint32_t firstChild;
+        uint32_t numChildren;
+    };
+
+    struct MappedChild
+    {
+        int32_t level;
+        uint32_t node;
+    };
+
+    static const uint32_t FILE_MAGIC = 0x504d5443;//"CTMP"
+    static const uint32_t FILE_VERSION = 1;
+
+    typedef std::pair<double, uint32_t> distNodePair;
+
+    const char* _data;
+    std::size_t _size;
+    const Header* _header;
+    const MappedNode* _nodes;
+    const MappedChild* _children;
+    const char* _labels;
+    const double* _coordinates;
+    //_reach[i] is CoverTree::reach(minLevel-1+i): how far a node can be
+    //from anything below it through children at that level or lower
+    std::vector<double> _reach;
+
+    MappedCoverTree(const MappedCoverTree&) = delete;
+    MappedCoverTree& operator=(const MappedCoverTree&) = delete;
+
+    static std::size_t roundUp(std::size_t n) { return (n+63)/64*64; }
+
+    /**
+     * The size of a file with header h, and where each section starts.
+     */
+    static std::size_t layout(const Header& h, std::size_t& children,
+                              std::size_t& labels, std::size_t& coordinates);
+
+    double reach(int level) const
+    {
+        return _reach[level-_header->minLevel+1];
+    }
+
+    /**
+     * Same as CoverTree::coverRadius.
+     */
+    double coverRadius(int level) const
+    {
+        return level <= _header->minLevel ? 0.0 : reach(level);
+    }
+
+    /**
+     * The children of node at level, like CoverTreeNode::children.
+     */
+    std::pair<const MappedChild*, const MappedChild*>
+        children(const MappedNode& node, int level) const;
+
+    double distance(const double* p, uint32_t node, double bound) const
+    {
+        double boundSq = bound*bound;
+        return sqrt(squaredDistance(p, point(_nodes[node].firstPoint),
+                                    _header->dimension, boundSq));
+    }
+
+    /**
+     * Leaves the k nearest nodes to p in nearest, nearest first: the same
+     * nodes CoverTree::kNearestNodes finds. The file keeps no parent
+     * distances or subtree radii, so this measures every child of the
+     * cover sets it keeps rather than pruning some by the triangle
+     * inequality first.
+     */
+    void kNearestNodes(const double* p, unsigned int k,
+                       std::vector<distNodePair>& nearest) const;
+public:
+    MappedCoverTree();
+    ~MappedCoverTree();
+
+    /**
+     * Writes tree in the layout above. Point must have getVec(), returning
+     * its coordinates as a vector of doubles, and getChar(), which is kept
+     * as the label of the point. Points with fewer coordinates than the
+     * longest one are padded with zeros, as CoverTreePoint::distance does.
+     * Returns false if out failed.
+     */
+    template<class Point, class Stats>
+    static bool write(const CoverTree<Point,Base,Stats>& tree, std::ostream& out);
+
+    /**
+     * Maps the file at path, closing whatever was open before. Only the
+     * header is read and checked (its version, base and the size of the
+     * file, and that its levels are those of distances a double can hold),
+     * so this is just as fast for any size of tree; verify checks the
+     * rest. Returns false, leaving nothing open, if the file can't be
+     * mapped or doesn't hold a tree of this version and base.
+     */
+    bool open(const std::string& path);
+
+    /**
+     * Unmaps the file, if one is open.
+     */
+    void close();
+
+    /**
+     * Reads the whole file and returns true iff it matches its checksum
+     * and every index in it is in range. Call it before trusting a file
+     * that might be damaged; queries on one that fails it may crash.
+     */
+    bool verify() const;
+
+    bool isOpen() const { return _data!=NULL; }
+
+    /**
+     * The number of points, and of coordinates of each point.
+     */
+    uint32_t size() const { return _data ? _header->numPoints : 0; }
+    uint32_t dimension() const { return _data ? _header->dimension : 0; }
+
+    /**
+     * The dimension() coordinates of point i, and its label.
+     */
+    const double* point(uint32_t i) const
+    {
+        return _coordinates + (std::size_t)i*_header->dimension;
+    }
+    char label(uint32_t i) const { return _labels[i]; }
+
+    /**
+     * Same as CoverTree::kNearestNeighbors, for a query of dimension()
+     * coordinates: every point of the k nearest nodes, nearest first,
+     * until there are at least k.
+     */
+    std::vector<Neighbor> kNearestNeighbors(const double* p,
+                                            unsigned int k) const;
+
+    /**
+     * Same as CoverTree::rangeSearch: every point within r of p, nearest
+     * first.
+     */
+    std::vector<Neighbor> rangeSearch(const double* p, double r) const;
+}; // MappedCoverTree class
+
+template<class Base>
+const uint32_t MappedCoverTree<Base>::FILE_MAGIC;
+
+template<class Base>
+const uint32_t MappedCoverTree<Base>::FILE_VERSION;
+
+template<class Base>
+MappedCoverTree<Base>::MappedCoverTree()
+    : _data(NULL), _size(0), _header(NULL), _nodes(NULL), _children(NULL),
+      _labels(NULL), _coordinates(NULL)
+{
+}
+
+template<class Base>
+MappedCoverTree<Base>::~MappedCoverTree()
+{
+    close();
+}
+
+template<class Base>
+std::size_t MappedCoverTree<Base>::layout(const Header& h,
+                                          std::size_t& children,
+                                          std::size_t& labels,
+                                          std::size_t& coordinates)
+{
+    children = sizeof(Header) + (std::size_t)h.numNodes*sizeof(MappedNode);
+    labels = children + (std::size_t)h.numChildren*sizeof(MappedChild);
+    coordinates = roundUp(labels + h.numPoints);
+    return coordinates + (std::size_t)h.numPoints*h.dimension*sizeof(double);
+}
+
+template<class Base>
+template<class Point, class Stats>
+bool MappedCoverTree<Base>::write(const CoverTree<Point,Base,Stats>& tree,
+                                  std::ostream& out)
+{
+    typedef typename CoverTree<Point,Base,Stats>::CoverTreeNode CoverTreeNode;
+    std::vector<const CoverTreeNode*> order;
+    std::vector<uint32_t> index;
+    tree.breadthFirst(order, index);
+
+    Header h = Header();
+    h.magic = FILE_MAGIC;
+    h.version = FILE_VERSION;
+    h.num = Base::num;
+    h.den = Base::den;
+    h.maxLevel = tree._maxLevel;
+    h.minLevel = tree._minLevel;
+    h.numNodes = order.size();
+    std::vector<MappedNode> nodes(order.size());
+    std::vector<MappedChild> children;
+    std::vector<const Point*> points;
+    for(unsigned int i=0;i<order.size();i++) {
+        const std::vector<Point>& p = order[i]->getPoints();
+        nodes[i].firstPoint = points.size();
+        nodes[i].numPoints = p.size();
+        for(unsigned int j=0;j<p.size();j++) {
+            points.push_back(&p[j]);
+            uint32_t dimension = p[j].getVec().size();
+            if(dimension > h.dimension) h.dimension = dimension;
+        }
+        typename CoverTree<Point,Base,Stats>::ChildRange c = order[i]->allChildren();
+        nodes[i].firstChild = children.size();
+        nodes[i].numChildren = c.size();
+        for(unsigned int j=0;j<c.size();j++) {
+            MappedChild child = {order[i]->childLevel(j), index[c[j]->getId()]};
+            children.push_back(child);
+        }
+    }
+    h.numChildren = children.size();
+    h.numPoints = points.size();
+
+    //the sections after the header, checksummed as they are laid out
+    std::size_t childStart, labelStart, coordStart;
+    std::size_t size = layout(h, childStart, labelStart, coordStart);
+    std::string body;
+    body.reserve(size - sizeof(Header));
+    body.append(reinterpret_cast<const char*>(nodes.data()),
+                nodes.size()*sizeof(MappedNode));
+    body.append(reinterpret_cast<const char*>(children.data()),
+                children.size()*sizeof(MappedChild));
+    for(unsigned int i=0;i<points.size();i++) body += points[i]->getChar();
+    body.resize(coordStart - sizeof(Header), '\0');
+    std::vector<double> row(h.dimension);
+    for(unsigned int i=0;i<points.size();i++) {
+        const auto& v = points[i]->getVec();
+        std::fill(std::copy(v.begin(), v.end(), row.begin()), row.end(), 0.0);
+        body.append(reinterpret_cast<const char*>(row.data()),
+                    row.size()*sizeof(double));
+    }
+    h.checksum = fnv1a(body.data(), body.size(), FNV_OFFSET_BASIS);
+
+    writeValue(out, h);
+    out.write(body.data(), body.size());
+    return (bool)out;
+}
+
+template<class Base>
+bool MappedCoverTree<Base>::open(const std::string& path)
+{
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    void* data = MAP_FAILED;
+    if(fstat(fd, &st)==0 && (std::size_t)st.st_size >= sizeof(Header)) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    //the mapping keeps the file alive by itself
+    ::close(fd);
+    if(data==MAP_FAILED) return false;
+    _data = static_cast<const char*>(data);
+    _size = st.st_size;
+    _header = reinterpret_cast<const Header*>(_data);
+
+    const Header& h = *_header;
+    std::size_t childStart, labelStart, coordStart;
+    //A tree's levels are those of its distances, give or take a couple,
+    //so levels beyond the smallest and largest doubles mean a bad header,
+    //whose span could otherwise make _reach below take any amount of memory
+    double base = double(Base::num)/Base::den;
+    double lowest = floor(log(DBL_MIN*DBL_EPSILON)/log(base)) - 2;
+    double highest = ceil(log(DBL_MAX)/log(base)) + 2;
+    if(h.magic!=FILE_MAGIC || h.version!=FILE_VERSION
+       || h.num!=Base::num || h.den!=Base::den
+       || h.maxLevel < h.minLevel
+       || h.minLevel < lowest || h.maxLevel > highest
+       || layout(h, childStart, labelStart, coordStart)!=_size) {
+        close();
+        return false;
+    }
+    _nodes = reinterpret_cast<const MappedNode*>(_data + sizeof(Header));
+    _children = reinterpret_cast<const MappedChild*>(_data + childStart);
+    _labels = _data + labelStart;
+    _coordinates = reinterpret_cast<const double*>(_data + coordStart);
+    for(int level=h.minLevel-1;level<=h.maxLevel;level++) {
+        _reach.push_back(pow(base, level+1)/(base-1));
+    }
+    return true;
+}
+
+template<class Base>
+void MappedCoverTree<Base>::close()
+{
+    if(_data!=NULL) munmap(const_cast<char*>(_data), _size);
+    _data = NULL;
+    _size = 0;
+    _header = NULL;
+    _reach.clear();
+}
+
+template<class Base>
+bool MappedCoverTree<Base>::verify() const
+{
+    if(_data==NULL) return false;
+    const Header& h = *_header;
+    if(fnv1a(_data + sizeof(Header), _size - sizeof(Header),
+             FNV_OFFSET_BASIS) != h.checksum) {
+        return false;
+    }
+    for(uint32_t i=0;i<h.numNodes;i++) {
+        const MappedNode& n = _nodes[i];
+        if(n.numPoints==0 || n.firstPoint > h.numPoints
+           || n.numPoints > h.numPoints - n.firstPoint
+           || n.firstChild > h.numChildren
+           || n.numChildren > h.numChildren - n.firstChild) {
+            return false;
+        }
+        for(uint32_t j=n.firstChild;j<n.firstChild+n.numChildren;j++) {
+            if(_children[j].node==0 || _children[j].node >= h.numNodes) {
+                return false;
+            }
+            if(j>n.firstChild && _children[j].level > _children[j-1].level) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+template<class Base>
+std::pair<const typename MappedCoverTree<Base>::MappedChild*,
+          const typename MappedCoverTree<Base>::MappedChild*>
+MappedCoverTree<Base>::children(const MappedNode& node, int level) const
+{
+    const MappedChild* first = _children + node.firstChild;
+    const MappedChild* last = first + node.numChildren;
+    //sorted by level in descending order
+    first = std::partition_point(first, last, [level](const MappedChild& c) {
+        return c.level > level;
+    });
+    last = std::partition_point(first, last, [level](const MappedChild& c) {
+        return c.level == level;
+    });
+    return std::make_pair(first, last);
+}
+
+template<class Base>
+void MappedCoverTree<Base>::kNearestNodes(const double* p, unsigned int k,
+                                          std::vector<distNodePair>& nearest) const
+{
+    nearest.clear();
+    if(_data==NULL || _header->numNodes==0) return;
+    std::vector<distNodePair> Qj;
+    double maxDist = distance(p, 0, DBL_MAX);
+    nearest.push_back(std::make_pair(maxDist, 0));
+    Qj.push_back(std::make_pair(maxDist, 0));
+    for(int level=_header->maxLevel;level>=_header->minLevel;level--) {
+        double radius = reach(level-1);
+        unsigned int size = Qj.size();
+        for(unsigned int i=0;i<size;i++) {
+            std::pair<const MappedChild*, const MappedChild*> c =
+                children(_nodes[Qj[i].second], level);
+            for(const MappedChild* it=c.first;it!=c.second;++it) {
+                double bound = nearest.size() < k ? DBL_MAX : maxDist+radius;
+                distNodePair dn =
+                    std::make_pair(distance(p, it->node, bound), it->node);
+                if(nearest.size() < k) {
+                    nearest.push_back(dn);
+                    std::push_heap(nearest.begin(), nearest.end());
+                    maxDist = nearest.front().first;
+                } else if(dn < nearest.front()) {
+                    std::pop_heap(nearest.begin(), nearest.end());
+                    nearest.back() = dn;
+                    std::push_heap(nearest.begin(), nearest.end());
+                    maxDist = nearest.front().first;
+                }
+                Qj.push_back(dn);
+            }
+        }
+        double bound = maxDist + radius;
+        Qj.erase(std::remove_if(Qj.begin(), Qj.end(),
+                                [bound](const distNodePair& d) {
+                                    return d.first > bound;
+                                }), Qj.end());
+    }
+    std::sort_heap(nearest.begin(), nearest.end());
+}
+
+template<class Base>
+std::vector<typename MappedCoverTree<Base>::Neighbor>
+MappedCoverTree<Base>::kNearestNeighbors(const double* p, unsigned int k) const
+{
+    std::vector<distNodePair> nearest;
+    kNearestNodes(p, k, nearest);
+    std::vector<Neighbor> kNN;
+    typename std::vector<distNodePair>::const_iterator it;
+    for(it=nearest.begin();it!=nearest.end() && kNN.size()<k;++it) {
+        const MappedNode& n = _nodes[it->second];
+        for(uint32_t i=n.firstPoint;i<n.firstPoint+n.numPoints;i++) {
+            kNN.push_back(std::make_pair(it->first, i));
+        }
+    }
+    return kNN;
+}
+
+template<class Base>
+std::vector<typename MappedCoverTree<Base>::Neighbor>
+MappedCoverTree<Base>::rangeSearch(const double* p, double r) const
+{
+    std::vector<Neighbor> found;
+    if(_data==NULL || _header->numNodes==0) return found;
+    std::vector<distNodePair> Q(1, std::make_pair(distance(p, 0, DBL_MAX), 0));
+    for(int level=_header->maxLevel;level>=_header->minLevel;level--) {
+        //a node farther than this has no descendant left within r
+        double bound = r + coverRadius(level-1);
+        unsigned int size = Q.size();
+        for(unsigned int i=0;i<size;i++) {
+            std::pair<const MappedChild*, const MappedChild*> c =
+                children(_nodes[Q[i].second], level);
+            for(const MappedChild* it=c.first;it!=c.second;++it) {
+                double d = distance(p, it->node, bound);
+                if(d <= bound) Q.push_back(std::make_pair(d, it->node));
+            }
+        }
+        Q.erase(std::remove_if(Q.begin(), Q.end(),
+                               [bound](const distNodePair& d) {
+                                   return d.first > bound;
+                               }), Q.end());
+    }
+    std::sort(Q.begin(), Q.end());
+    typename std::vector<distNodePair>::const_iterator it;
+    for(it=Q.begin();it!=Q.end() && it->first<=r;++it) {
+        const MappedNode& n = _nodes[it->second];
+        for(uint32_t i=n.firstPoint;i<n.firstPoint+n.numPoints;i++) {
+            found.push_back(std::make_pair(it->first, i));
+        }
+    }
+    return found;
+}
+
+#endif // _COVER_TREE_MAPPED_H
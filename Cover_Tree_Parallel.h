@@ -0,0 +1,305 @@
+#ifndef _COVER_TREE_PARALLEL_H
+#define _COVER_TREE_PARALLEL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <memory>
+
+/**
+ * Returns how many threads to use for n independent jobs when threads were
+ * asked for: one per hardware thread if threads is 0, and never more than n
+ * (but at least 1).
+ */
+inline unsigned int workerCount(unsigned int threads, std::size_t n)
+{
+    if(threads == 0) threads = std::thread::hardware_concurrency();
+    if(threads > n) threads = n;
+    return threads == 0 ? 1 : threads;
+}
+
+/**
+ * The part of [0,n) one parallelFor worker has not started yet. The owner
+ * takes indices from the front and thieves take the back half.
+ */
+struct WorkRange
+{
+    std::mutex lock;
+    std::size_t begin, end;
+    WorkRange() : begin(0), end(0) {}
+};
+
+/**
+ * One parallelFor worker: runs body on its own range until it is empty,
+ * then steals half of the largest remaining range of another worker, until
+ * there is nothing left to steal.
+ */
+template<class Body>
+void workStealingLoop(unsigned int worker, std::vector<WorkRange>& ranges,
+                      std::size_t grain, Body& body)
+{
+    WorkRange& mine = ranges[worker];
+    while(true) {
+        std::size_t first, last;
+        {
+            std::lock_guard<std::mutex> guard(mine.lock);
+            first = mine.begin;
+            last = std::min(mine.end, first + grain);
+            mine.begin = last;
+        }
+        if(first < last) {
+            for(std::size_t i=first;i<last;i++) body(worker, i);
+            continue;
+        }
+        //out of work: find the victim with the most left, rechecking under
+        //its lock since it may have moved on since we looked.
+        unsigned int victim = worker;
+        std::size_t most = 0;
+        for(unsigned int w=0;w<ranges.size();w++) {
+            std::lock_guard<std::mutex> guard(ranges[w].lock);
+            if(ranges[w].end - ranges[w].begin > most) {
+                most = ranges[w].end - ranges[w].begin;
+                victim = w;
+            }
+        }
+        if(most == 0) return;
+        std::size_t stolenBegin, stolenEnd;
+        {
+            std::lock_guard<std::mutex> guard(ranges[victim].lock);
+            WorkRange& v = ranges[victim];
+            stolenEnd = v.end;
+            stolenBegin = v.begin + (v.end - v.begin) / 2;
+            v.end = stolenBegin;
+        }
+        std::lock_guard<std::mutex> guard(mine.lock);
+        mine.begin = stolenBegin;
+        mine.end = stolenEnd;
+    }
+}
+
+/**
+ * Calls body(worker, i) once for every i in [0,n), spread over threads
+ * threads (see workerCount), and returns when every call has returned.
+ * worker is in [0,threads) and no two calls running at the same time share
+ * one, so it can index per-thread working memory. Each thread starts with
+ * an equal contiguous share of [0,n) and steals from the others once its
+ * own runs out. If a call throws, the first exception is rethrown here
+ * after every thread has finished.
+ */
+template<class Body>
+void parallelFor(std::size_t n, unsigned int threads, Body body)
+{
+    threads = workerCount(threads, n);
+    if(threads == 1) {
+        for(std::size_t i=0;i<n;i++) body(0, i);
+        return;
+    }
+    std::vector<WorkRange> ranges(threads);
+    for(unsigned int w=0;w<threads;w++) {
+        ranges[w].begin = n * w / threads;
+        ranges[w].end = n * (w+1) / threads;
+    }
+    //small enough that the last chunks balance, large enough that the
+    //locking is noise
+    std::size_t grain = std::max<std::size_t>(1, std::min<std::size_t>
+                                              (64, n / (threads * 64)));
+
+    std::mutex errorLock;
+    std::exception_ptr error;
+    auto run = [&](unsigned int worker) {
+        try {
+            workStealingLoop(worker, ranges, grain, body);
+        } catch(...) {
+            std::lock_guard<std::mutex> guard(errorLock);
+            if(!error) error = std::current_exception();
+            //give up the rest of this worker's range so the others finish
+            std::lock_guard<std::mutex> rangeGuard(ranges[worker].lock);
+            ranges[worker].begin = ranges[worker].end;
+        }
+    };
+    std::vector<std::thread> pool;
+    for(unsigned int w=1;w<threads;w++) pool.push_back(std::thread(run, w));
+    run(0);
+    for(unsigned int w=0;w<pool.size();w++) pool[w].join();
+    if(error) std::rethrow_exception(error);
+}
+
+/**
+ * A fixed set of threads running tasks from a shared queue, for fork-join
+ * work whose shape isn't known up front (unlike parallelFor's). A thread
+ * waiting for its tasks runs queued ones in the meantime, so tasks may
+ * themselves spawn tasks and wait for them without running out of threads.
+ * The thread that owns the pool counts as one of its threads and only works
+ * while it waits.
+ */
+class TaskPool
+{
+ private:
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::deque<std::function<void()> > _queue;
+    std::vector<std::thread> _threads;
+    bool _stop;
+    std::exception_ptr _error;
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    /**
+     * Runs task (the lock must not be held), recording the first exception.
+     */
+    void run(std::function<void()>& task)
+    {
+        try {
+            task();
+        } catch(...) {
+            std::lock_guard<std::mutex> guard(_lock);
+            if(!_error) _error = std::current_exception();
+        }
+    }
+
+    void work()
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        while(true) {
+            if(!_queue.empty()) {
+                std::function<void()> task;
+                task.swap(_queue.front());
+                _queue.pop_front();
+                guard.unlock();
+                run(task);
+                guard.lock();
+                _wake.notify_all();
+            } else if(_stop) {
+                return;
+            } else {
+                _wake.wait(guard);
+            }
+        }
+    }
+ public:
+    /**
+     * threads counts the calling thread, so threads-1 are started (see
+     * workerCount for what 0 means).
+     */
+    explicit TaskPool(unsigned int threads) : _stop(false)
+    {
+        threads = workerCount(threads, ~0u);
+        for(unsigned int i=1;i<threads;i++) {
+            _threads.push_back(std::thread(&TaskPool::work, this));
+        }
+    }
+
+    ~TaskPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for(unsigned int i=0;i<_threads.size();i++) _threads[i].join();
+    }
+
+    unsigned int size() const { return _threads.size()+1; }
+
+    /**
+     * Queues task, then sets done once it has run (even if it threw).
+     */
+    void spawn(const std::function<void()>& task, std::atomic<bool>& done)
+    {
+        {
+            std::lock_guard<std::mutex> guard(_lock);
+            _queue.push_back([task, &done]() {
+                struct Finish
+                {
+                    std::atomic<bool>& done;
+                    ~Finish() { done.store(true); }
+                } finish = {done};
+                task();
+            });
+        }
+        _wake.notify_one();
+    }
+
+    /**
+     * Runs queued tasks until finished() returns true. finished is called
+     * with the pool locked, and must become true only through tasks of
+     * this pool.
+     */
+    template<class Finished>
+    void waitUntil(Finished finished)
+    {
+        std::unique_lock<std::mutex> guard(_lock);
+        while(!finished()) {
+            if(!_queue.empty()) {
+                std::function<void()> task;
+                task.swap(_queue.front());
+                _queue.pop_front();
+                guard.unlock();
+                run(task);
+                guard.lock();
+                _wake.notify_all();
+            } else {
+                _wake.wait(guard);
+            }
+        }
+    }
+
+    /**
+     * Calls body(i) for every i in [0,n) in chunks of grain, some of them
+     * on other threads, and returns once every call has returned. If a
+     * call on this thread throws, the exception is passed on only after
+     * the other chunks, which refer to body, have finished.
+     */
+    template<class Body>
+    void forEach(std::size_t n, std::size_t grain, Body body)
+    {
+        std::size_t chunks = (n + grain - 1) / grain;
+        std::unique_ptr<std::atomic<bool>[]> done(new std::atomic<bool>[chunks]);
+        struct Join
+        {
+            TaskPool& pool;
+            std::atomic<bool>* done;
+            std::size_t spawned;//chunks [1,spawned) are queued
+            ~Join()
+            {
+                pool.waitUntil([this]() {
+                    for(std::size_t c=1;c<spawned;c++) {
+                        if(!done[c].load()) return false;
+                    }
+                    return true;
+                });
+            }
+        } join = {*this, done.get(), 1};
+        for(std::size_t c=1;c<chunks;c++) {
+            done[c].store(false);
+            std::size_t first = c*grain, last = std::min(n, first+grain);
+            spawn([&body, first, last]() {
+                for(std::size_t i=first;i<last;i++) body(i);
+            }, done[c]);
+            join.spawned = c+1;
+        }
+        for(std::size_t i=0;i<std::min(n, grain);i++) body(i);
+    }
+
+    /**
+     * Rethrows the first exception thrown by a task, if there was one.
+     */
+    void rethrow()
+    {
+        std::lock_guard<std::mutex> guard(_lock);
+        if(_error) {
+            std::exception_ptr error = _error;
+            _error = std::exception_ptr();
+            std::rethrow_exception(error);
+        }
+    }
+}; // TaskPool class
+
+#endif // _COVER_TREE_PARALLEL_H
@@ -1,24 +1,28 @@
 #include "Cover_Tree_Point.h"
+#include "Cover_Tree_Serial.h"
 #include <vector>
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 
 using namespace std;
 
 double CoverTreePoint::distance(const CoverTreePoint& p) const {
-    const vector<double>& otherVec = p.getVec();
-    const vector<double>& longer = _vec.size() > otherVec.size() ? _vec : otherVec;
-    const vector<double>& shorter = _vec.size() <= otherVec.size() ? _vec : otherVec;
-    double dist = 0;
+    // Shares the bounded code path so both always agree exactly.
+    return distance(p, HUGE_VAL);
+}
+
+double CoverTreePoint::distance(const CoverTreePoint& p, double bound) const {
+    const Coordinates& otherVec = p.coordinates();
+    const Coordinates& longer = _vec.size() > otherVec.size() ? _vec : otherVec;
+    const Coordinates& shorter = _vec.size() <= otherVec.size() ? _vec : otherVec;
+    double boundSq = bound*bound;
     int shorterSize = shorter.size();
     int longerSize = longer.size();
     // First, compute the distance in the lower-dimensional space
-    for (int i = 0; i < shorterSize; i++) {
-        double d = longer[i] - shorter[i];
-        dist += d*d;
-    }
+    double dist = squaredDistance(shorter.data(), longer.data(), shorterSize, boundSq);
     // Now add the higher dimensions to the calculation
-    for (int i = shorterSize; i < longerSize; i++) {
+    for (int i = shorterSize; i < longerSize && dist <= boundSq; i++) {
         double d = longer[i];
         dist += d*d;
     }
@@ -26,7 +30,11 @@ double CoverTreePoint::distance(const CoverTreePoint& p) const {
     return sqrt(dist);
 }
 
-const vector<double>& CoverTreePoint::getVec() const {
+vector<double> CoverTreePoint::getVec() const {
+    return vector<double>(_vec.begin(), _vec.end());
+}
+
+const CoverTreePoint::Coordinates& CoverTreePoint::coordinates() const {
     return _vec;
 }
 
@@ -35,7 +43,7 @@ char CoverTreePoint::getChar() const {
 }
 
 void CoverTreePoint::print() const {
-    vector<double>::const_iterator it;
+    Coordinates::const_iterator it;
     cout << "point " << _name << ": ";
     for(it = _vec.begin(); it != _vec.end(); it++) {
         cout << *it << " ";
@@ -44,5 +52,29 @@ void CoverTreePoint::print() const {
 }
 
 bool CoverTreePoint::operator==(const CoverTreePoint& p) const {
-    return (_vec == p.getVec() && _name == p.getChar());
+    return (_vec == p.coordinates() && _name == p.getChar());
+}
+
+void CoverTreePoint::save(ostream& out) const {
+    writeValue(out, (uint32_t)_vec.size());
+    out.write(reinterpret_cast<const char*>(_vec.data()),
+              _vec.size()*sizeof(double));
+    writeValue(out, _name);
+}
+
+CoverTreePoint CoverTreePoint::load(istream& in) {
+    CoverTreePoint p(vector<double>(), 'a');
+    uint32_t size = 0;
+    readValue(in, size);
+    // Grow a chunk at a time, so a corrupt size runs into the end of the
+    // stream before it can allocate much.
+    const uint32_t chunk = 1024;
+    while(in && p._vec.size() < size) {
+        size_t old = p._vec.size();
+        p._vec.resize(old + min(chunk, size - (uint32_t)old));
+        in.read(reinterpret_cast<char*>(p._vec.data() + old),
+                (p._vec.size() - old)*sizeof(double));
+    }
+    readValue(in, p._name);
+    return p;
 }
@@ -1,25 +1,43 @@
 #ifndef _COVER_TREE_POINT_H
 #define _COVER_TREE_POINT_H
 
+#include "Cover_Tree_Distance.h"
+
 #include <vector>
+#include <iosfwd>
 
 /**
  * A simple point class containing a vector of doubles and a single char name.
+ * The coordinates are kept in cache-line-aligned storage for the SIMD
+ * distance kernels.
  */
 class CoverTreePoint
 {
+public:
+    typedef std::vector<double, AlignedAllocator<double> > Coordinates;
 private:
-    std::vector<double> _vec;
+    Coordinates _vec;
     char _name;
 public:
-    CoverTreePoint(std::vector<double> v, char name) : _vec(v), _name(name) {}
+    CoverTreePoint(const std::vector<double>& v, char name)
+        : _vec(v.begin(), v.end()), _name(name) {}
     // Euclidean distance. If one of the points is higher-dimensional than the
     // other, will pad the other with 0's.
     double distance(const CoverTreePoint& p) const;
-    const std::vector<double>& getVec() const;
+    // Same as distance(p), but may stop early and return any value greater
+    // than bound once the distance is known to exceed it.
+    double distance(const CoverTreePoint& p, double bound) const;
+    // A copy of the coordinates, as a plain vector.
+    std::vector<double> getVec() const;
+    // The coordinates themselves, in aligned storage.
+    const Coordinates& coordinates() const;
     char getChar() const;
     void print() const;
     bool operator==(const CoverTreePoint&) const;
+    // Writes the point in binary, as CoverTree::save needs.
+    void save(std::ostream& out) const;
+    // Reads a point written by save, leaving in failed if it can't.
+    static CoverTreePoint load(std::istream& in);
 };
 
 #endif // _COVER_TREE_POINT_H
@@ -0,0 +1,115 @@
+#ifndef _COVER_TREE_SERIAL_H
+#define _COVER_TREE_SERIAL_H
+
+#include <streambuf>
+#include <istream>
+#include <ostream>
+#include <stdint.h>
+#include <cstddef>
+
+/**
+ * The basis every FNV-1a checksum starts from.
+ */
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+
+/**
+ * Adds n bytes at s to the 64-bit FNV-1a checksum sum and returns it.
+ */
+inline uint64_t fnv1a(const char* s, std::size_t n, uint64_t sum)
+{
+    for(std::size_t i=0;i<n;i++) {
+        sum ^= (unsigned char)s[i];
+        sum *= 1099511628211ULL;
+    }
+    return sum;
+}
+
+/**
+ * A stream buffer which passes everything read or written through it on to
+ * another stream buffer, keeping a 64-bit FNV-1a checksum of those bytes.
+ * It buffers nothing itself, so reading through it never takes more out of
+ * the underlying buffer than was asked for, and whatever follows (such as
+ * the checksum itself) can still be read from the underlying stream.
+ */
+class ChecksumBuf : public std::streambuf
+{
+private:
+    std::streambuf* _target;
+    uint64_t _sum;
+
+    void add(const char* s, std::streamsize n)
+    {
+        if(n > 0) _sum = fnv1a(s, n, _sum);
+    }
+protected:
+    int_type overflow(int_type c)
+    {
+        if(traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        char ch = traits_type::to_char_type(c);
+        if(traits_type::eq_int_type(_target->sputc(ch), traits_type::eof())) {
+            return traits_type::eof();
+        }
+        add(&ch, 1);
+        return c;
+    }
+    std::streamsize xsputn(const char* s, std::streamsize n)
+    {
+        n = _target->sputn(s, n);
+        add(s, n);
+        return n;
+    }
+    int_type underflow()
+    {
+        return _target->sgetc();
+    }
+    int_type uflow()
+    {
+        int_type c = _target->sbumpc();
+        if(!traits_type::eq_int_type(c, traits_type::eof())) {
+            char ch = traits_type::to_char_type(c);
+            add(&ch, 1);
+        }
+        return c;
+    }
+    std::streamsize xsgetn(char* s, std::streamsize n)
+    {
+        n = _target->sgetn(s, n);
+        add(s, n);
+        return n;
+    }
+    int sync()
+    {
+        return _target->pubsync();
+    }
+public:
+    explicit ChecksumBuf(std::streambuf* target)
+        : _target(target), _sum(FNV_OFFSET_BASIS) {}
+    /**
+     * The checksum of every byte that has gone through so far.
+     */
+    uint64_t sum() const { return _sum; }
+};
+
+/**
+ * Writes the bytes of a trivially copyable value in the byte order of this
+ * machine.
+ */
+template<class T>
+inline void writeValue(std::ostream& out, const T& value)
+{
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * Reads a value written by writeValue. Returns false (with the stream
+ * failed) if the stream ran out first.
+ */
+template<class T>
+inline bool readValue(std::istream& in, T& value)
+{
+    return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+#endif // _COVER_TREE_SERIAL_H
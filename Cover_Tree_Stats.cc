@@ -0,0 +1,101 @@
+#include "Cover_Tree_Stats.h"
+
+using namespace std;
+
+static const char* const KIND_NAMES[OPERATION_KINDS] = {
+    "knn_query", "range_query", "insert", "remove",
+    "remove_batch"
+};
+
+void Histogram::add(uint64_t value) {
+    int bucket = 0;
+    for (uint64_t v = value; v != 0; v >>= 1) bucket++;
+    _buckets[bucket]++;
+    _count++;
+    _sum += value;
+    if (value > _max) _max = value;
+}
+
+void Histogram::merge(const Histogram& h) {
+    for (int i = 0; i < BUCKETS; i++) _buckets[i] += h._buckets[i];
+    _count += h._count;
+    _sum += h._sum;
+    if (h._max > _max) _max = h._max;
+}
+
+void Histogram::clear() {
+    for (int i = 0; i < BUCKETS; i++) _buckets[i] = 0;
+    _count = _sum = _max = 0;
+}
+
+uint64_t Histogram::quantile(double q) const {
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += _buckets[i];
+        if (seen > 0 && seen >= q*_count) {
+            uint64_t top = i == 0 ? 0 : (i == 64 ? ~0ULL : (1ULL << i) - 1);
+            return top < _max ? top : _max;
+        }
+    }
+    return _max;
+}
+
+void Histogram::writeJson(ostream& out) const {
+    int used = BUCKETS;
+    while (used > 0 && _buckets[used-1] == 0) used--;
+    out << "{\"count\": " << _count << ", \"sum\": " << _sum
+        << ", \"max\": " << _max << ", \"buckets\": [";
+    for (int i = 0; i < used; i++) {
+        out << (i ? ", " : "") << _buckets[i];
+    }
+    out << "]}";
+}
+
+void OperationStats::Summary::merge(const Summary& s) {
+    distances.merge(s.distances);
+    levels.merge(s.levels);
+    coverSets.merge(s.coverSets);
+    touched.merge(s.touched);
+    pruned.merge(s.pruned);
+}
+
+void OperationStats::add(const Operation& op) {
+    Summary& s = _summaries[op.kind];
+    s.distances.add(op.distances);
+    s.levels.add(op.levels());
+    for (size_t i = 0; i < op.coverSets.size(); i++) s.coverSets.add(op.coverSets[i]);
+    s.touched.add(op.touched);
+    s.pruned.add(op.pruned);
+}
+
+void OperationStats::merge(const OperationStats& stats) {
+    for (int i = 0; i < OPERATION_KINDS; i++) _summaries[i].merge(stats._summaries[i]);
+}
+
+void OperationStats::clear() {
+    for (int i = 0; i < OPERATION_KINDS; i++) _summaries[i] = Summary();
+}
+
+void OperationStats::writeJson(ostream& out) const {
+    out << "{";
+    bool first = true;
+    for (int i = 0; i < OPERATION_KINDS; i++) {
+        const Summary& s = _summaries[i];
+        if (s.distances.count() == 0) continue;
+        out << (first ? "\n" : ",\n") << "  \"" << KIND_NAMES[i] << "\": {\n";
+        out << "    \"count\": " << s.distances.count() << ",\n";
+        out << "    \"distances\": ";
+        s.distances.writeJson(out);
+        out << ",\n    \"levels\": ";
+        s.levels.writeJson(out);
+        out << ",\n    \"cover_sets\": ";
+        s.coverSets.writeJson(out);
+        out << ",\n    \"touched\": ";
+        s.touched.writeJson(out);
+        out << ",\n    \"pruned\": ";
+        s.pruned.writeJson(out);
+        out << "\n  }";
+        first = false;
+    }
+    out << "\n}";
+}
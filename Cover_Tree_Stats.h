@@ -0,0 +1,151 @@
+#ifndef _COVER_TREE_STATS_H
+#define _COVER_TREE_STATS_H
+
+#include <vector>
+#include <ostream>
+#include <cstddef>
+#include <stdint.h>
+
+/**
+ * The operations of a cover tree which search it, and so are measured by
+ * its Stats (see CoverTree).
+ */
+enum OperationKind
+{
+    KNN_QUERY,
+    RANGE_QUERY,
+    INSERT,
+    REMOVE,
+    REMOVE_BATCH,
+    OPERATION_KINDS//the number of kinds above
+};
+
+/**
+ * The Stats of a cover tree which measures nothing. Every call on it is
+ * empty and inline, so a tree using it (the default) compiles to the same
+ * code as if the calls weren't there.
+ *
+ * Any other Stats class needs the same members. The tree calls
+ * Operation::begin when it starts an operation, the other members of
+ * Operation as it goes, and Stats::add once the operation is done. A
+ * Stats whose enabled is false must measure nothing: the tree then keeps
+ * no total, takes no lock, and never calls add or merge.
+ */
+struct NoStats
+{
+    static const bool enabled = false;
+
+    struct Operation
+    {
+        void begin(OperationKind) {}
+        void distance() {}
+        void level(std::size_t) {}
+        void touch(std::size_t) {}
+        void prune(std::size_t) {}
+    };
+
+    void add(const Operation&) {}
+    void merge(const NoStats&) {}
+};
+
+/**
+ * What one operation on a cover tree did.
+ */
+struct OperationRecord
+{
+    OperationKind kind;
+    uint64_t distances;//distance evaluations
+    uint64_t touched;//cover set entries whose children were looked at
+    uint64_t pruned;//nodes measured or kept, then left out of a cover set
+    //the size of the cover set built at each level visited, from the top
+    std::vector<uint32_t> coverSets;
+
+    OperationRecord() : kind(KNN_QUERY), distances(0), touched(0), pruned(0) {}
+    /**
+     * Starts recording an operation of kind kind. The memory of coverSets
+     * is kept, so a record reused for each operation stops allocating.
+     */
+    void begin(OperationKind k)
+    {
+        kind = k;
+        distances = touched = pruned = 0;
+        coverSets.clear();
+    }
+    void distance() { distances++; }
+    void level(std::size_t size) { coverSets.push_back(size); }
+    void touch(std::size_t n) { touched += n; }
+    void prune(std::size_t n) { pruned += n; }
+    std::size_t levels() const { return coverSets.size(); }
+};
+
+/**
+ * Counts of values by their number of bits: bucket 0 holds the zeros,
+ * and bucket i>0 the values from 2^(i-1) to 2^i-1.
+ */
+class Histogram
+{
+public:
+    static const int BUCKETS = 65;
+private:
+    uint64_t _buckets[BUCKETS];
+    uint64_t _count;
+    uint64_t _sum;
+    uint64_t _max;
+public:
+    Histogram() { clear(); }
+    void add(uint64_t value);
+    void merge(const Histogram& h);
+    void clear();
+    uint64_t count() const { return _count; }
+    uint64_t sum() const { return _sum; }
+    uint64_t max() const { return _max; }
+    double mean() const { return _count ? (double)_sum/_count : 0.0; }
+    uint64_t bucket(int i) const { return _buckets[i]; }
+    /**
+     * An upper bound on the value below which the fraction q of the values
+     * fall: the largest value of the bucket holding it, or the maximum.
+     */
+    uint64_t quantile(double q) const;
+    /**
+     * Writes {"count":..,"sum":..,"max":..,"buckets":[..]}, leaving off the
+     * empty buckets past the last full one.
+     */
+    void writeJson(std::ostream& out) const;
+};
+
+/**
+ * The Stats of a cover tree which keeps, for each kind of operation, how
+ * many there were and histograms of what each one did (see
+ * OperationRecord). The cover set histogram counts every level of every
+ * operation.
+ */
+class OperationStats
+{
+public:
+    static const bool enabled = true;
+    typedef OperationRecord Operation;
+
+    struct Summary
+    {
+        Histogram distances;
+        Histogram levels;
+        Histogram coverSets;
+        Histogram touched;
+        Histogram pruned;
+        void merge(const Summary& s);
+    };
+private:
+    Summary _summaries[OPERATION_KINDS];
+public:
+    void add(const Operation& op);
+    void merge(const OperationStats& stats);
+    void clear();
+    const Summary& summary(OperationKind kind) const { return _summaries[kind]; }
+    /**
+     * Writes one JSON object with a member for each kind of operation
+     * there has been, holding its histograms.
+     */
+    void writeJson(std::ostream& out) const;
+};
+
+#endif // _COVER_TREE_STATS_H
@@ -0,0 +1,91 @@
+// Times every distance kernel this CPU supports (see Cover_Tree_Distance.h)
+// on float and double vectors of increasing dimension, and prints the time
+// per distance and the speedup over the scalar kernel.
+
+#include "Cover_Tree_Distance.h"
+
+#include <vector>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <chrono>
+
+using namespace std;
+
+// How many vectors to compute distances between, and how many distances to
+// time per measurement.
+static const unsigned int NUM_VECTORS = 256;
+static const unsigned int NUM_DISTANCES = 2000000;
+
+// Returns the nanoseconds per distance taken by f over vectors of dimension
+// dim stored back to back in data.
+template<class T, class F>
+static double timeKernel(F f, const vector<T, AlignedAllocator<T> >& data,
+                         unsigned int dim, unsigned int repeats) {
+    volatile T sink = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (unsigned int r = 0; r < repeats; r++) {
+        for (unsigned int i = 0; i < NUM_VECTORS; i++) {
+            unsigned int j = (i * 7 + r) % NUM_VECTORS;
+            sink = sink + f(&data[i * dim], &data[j * dim], dim, (T)HUGE_VAL);
+        }
+    }
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count() / (repeats * (double)NUM_VECTORS);
+}
+
+template<class T> struct KernelType;
+template<> struct KernelType<double> {
+    typedef double (*type)(const double*, const double*, unsigned int, double);
+};
+template<> struct KernelType<float> {
+    typedef float (*type)(const float*, const float*, unsigned int, float);
+};
+
+template<class T> typename KernelType<T>::type kernelFor(const DistanceKernel& k);
+template<> KernelType<double>::type kernelFor<double>(const DistanceKernel& k) {
+    return k.squaredDistance;
+}
+template<> KernelType<float>::type kernelFor<float>(const DistanceKernel& k) {
+    return k.squaredDistanceFloat;
+}
+
+template<class T>
+static void benchmark(const char* type) {
+    vector<DistanceKernel> kernels = supportedDistanceKernels();
+    cout << type << " (ns per distance, speedup over scalar in parentheses)\n";
+    cout << setw(6) << "dim";
+    for (unsigned int k = 0; k < kernels.size(); k++) {
+        cout << setw(18) << kernels[k].name;
+    }
+    cout << "\n";
+
+    unsigned int dims[] = {2, 3, 8, 16, 32, 64, 100, 128, 256, 512, 1024};
+    for (unsigned int d = 0; d < sizeof(dims) / sizeof(dims[0]); d++) {
+        unsigned int dim = dims[d];
+        vector<T, AlignedAllocator<T> > data(NUM_VECTORS * dim);
+        for (unsigned int i = 0; i < data.size(); i++) {
+            data[i] = (T)rand() / (T)RAND_MAX;
+        }
+        unsigned int repeats = NUM_DISTANCES / (NUM_VECTORS * dim) + 1;
+
+        cout << setw(6) << dim;
+        double scalar = 0;
+        for (unsigned int k = 0; k < kernels.size(); k++) {
+            double ns = timeKernel(kernelFor<T>(kernels[k]), data, dim, repeats);
+            if (k == 0) scalar = ns;
+            cout << setw(10) << fixed << setprecision(2) << ns
+                 << " (" << setw(4) << setprecision(1) << scalar / ns << "x)";
+        }
+        cout << "\n";
+    }
+    cout << "\n";
+}
+
+int main() {
+    srand(1);
+    cout << "Selected kernel: " << distanceKernel().name << "\n\n";
+    benchmark<double>("double");
+    benchmark<float>("float");
+    return 0;
+}
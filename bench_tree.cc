@@ -0,0 +1,463 @@
+// Times CoverTree against Langford's implementation in langford/ on the same
+// points and queries: build time, the latency of single kNN queries, distance
+// evaluations and peak memory, and checks both engines' answers.
+//
+//   bench_tree [--k K] [--queries Q] [--engine both|covertree|langford]
+//              [--stats FILE] [--epsilon E1,E2,...]
+//              (--uniform N D [--seed S] | data.point)
+//
+// With a .point file (e.g. from gen_data.py), the queries and their answers
+// come from the .query file next to it if there is one. Otherwise Q queries
+// are drawn uniformly from the bounding box of the points and answered by
+// brute force. Each engine runs in a process of its own, so their peak RSS
+// can be told apart.
+//
+// With --stats FILE, the CoverTree engine also measures each query with
+// OperationStats (see Cover_Tree_Stats.h), which costs it some latency, and
+// writes the histograms to FILE as JSON.
+//
+// With --epsilon, only CoverTree runs, answering the queries once for each
+// epsilon given as (1+epsilon)-approximate queries (0 is exact), and the
+// table is one of recall against latency instead: for each epsilon, the
+// fraction of the true k nearest neighbors found, the worst ratio of the kth
+// distance found to the true one, and the latency and distance evaluations,
+// ready to plot.
+
+#include "Cover_Tree.h"
+#include "Cover_Tree_Point.h"
+#include "Cover_Tree_Loader.h"
+
+#include <vector>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <ratio>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "langford/cover_tree.h"
+
+using namespace std;
+
+// The length of Langford's points, defined in langford/point.cc.
+extern int point_len;
+
+// Distance evaluations so far by whichever engine this process runs. The
+// benchmark is single-threaded, so a plain counter does.
+static unsigned long long evaluations = 0;
+
+// langford/cover_tree.cc is compiled with -Ddistance=counted_distance, so
+// every distance Langford's tree computes comes through here.
+float counted_distance(point p1, point p2, float upper_bound) {
+    evaluations++;
+    return distance(p1, p2, upper_bound);
+}
+
+// A CoverTreePoint which counts its distance evaluations.
+class CountedPoint : public CoverTreePoint {
+public:
+    CountedPoint(const vector<double>& v) : CoverTreePoint(v, 'a') {}
+    double distance(const CountedPoint& p) const {
+        evaluations++;
+        return CoverTreePoint::distance(p);
+    }
+    double distance(const CountedPoint& p, double bound) const {
+        evaluations++;
+        return CoverTreePoint::distance(p, bound);
+    }
+};
+
+// Points and queries as plain rows of coordinates, all of one dimension.
+struct Dataset {
+    string name;
+    unsigned int dim;
+    vector<vector<double> > points;
+    vector<vector<double> > queries;
+    unsigned int k;
+    // answers[i] is the distances to the k nearest points of queries[i],
+    // nearest first.
+    vector<vector<double> > answers;
+};
+
+// What one engine measured.
+struct Result {
+    double buildSeconds;
+    unsigned long long buildEvaluations;
+    unsigned long long queryEvaluations;
+    vector<double> latencies;  // microseconds per query
+    unsigned int wrong;        // queries whose answer didn't match
+    long startRss, peakRss;    // kilobytes
+};
+
+static double euclidean(const vector<double>& a, const vector<double>& b) {
+    double sum = 0;
+    for (unsigned int i = 0; i < a.size(); i++) {
+        double d = a[i] - b[i];
+        sum += d*d;
+    }
+    return sqrt(sum);
+}
+
+static vector<vector<double> > toRows(const PointRows& rows, size_t first,
+                                      size_t last, unsigned int dim) {
+    vector<vector<double> > out;
+    for (size_t i = first; i < last; i++) {
+        vector<double> row(rows.row(i), rows.row(i) + rows.rowSize(i));
+        row.resize(dim, 0.0);
+        out.push_back(row);
+    }
+    return out;
+}
+
+// Reads the .query file written by gen_data.py alongside a .point file: k,
+// then each query followed by its k nearest points, and any more which tie
+// with the kth. Since the number of answers varies, a row only counts as
+// one more tie if it is as far from the query as the kth answer.
+static bool readQueries(const string& path, Dataset& data) {
+    PointRows rows;
+    if (!loadPointFile(path, rows) || rows.size() == 0) return false;
+    data.k = (unsigned int)rows.row(0)[0];
+    vector<vector<double> > all = toRows(rows, 1, rows.size(), data.dim);
+    for (size_t i = 0; data.k > 0 && i + data.k < all.size();) {
+        const vector<double>& q = all[i];
+        vector<double> answer;
+        size_t j = i + 1;
+        for (; j < all.size() && j <= i + data.k; j++) {
+            answer.push_back(euclidean(q, all[j]));
+        }
+        while (j < all.size() && euclidean(q, all[j]) == answer.back()) j++;
+        sort(answer.begin(), answer.end());
+        data.queries.push_back(q);
+        data.answers.push_back(answer);
+        i = j;
+    }
+    return true;
+}
+
+static void bruteForceAnswers(Dataset& data) {
+    for (size_t i = 0; i < data.queries.size(); i++) {
+        vector<double> dists;
+        for (size_t j = 0; j < data.points.size(); j++) {
+            dists.push_back(euclidean(data.queries[i], data.points[j]));
+        }
+        unsigned int k = min<size_t>(data.k, dists.size());
+        partial_sort(dists.begin(), dists.begin() + k, dists.end());
+        dists.resize(k);
+        data.answers.push_back(dists);
+    }
+}
+
+// Whether the found distances start with the k answers, allowing for the
+// rounding of Langford's float coordinates.
+static bool matches(vector<double> found, const vector<double>& answer) {
+    if (found.size() < answer.size()) return false;
+    sort(found.begin(), found.end());
+    for (size_t i = 0; i < answer.size(); i++) {
+        if (fabs(found[i] - answer[i]) > 1e-5 * (answer[i] + 1e-3)) return false;
+    }
+    return true;
+}
+
+// The resident set of this process right now, in kilobytes.
+static long currentRss() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static long peakRss() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static double microsecondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+// Where --stats sends the query stats of the CoverTree engine.
+static string statsPath;
+
+static void writeStats(const NoStats&) {}
+
+static void writeStats(const OperationStats& stats) {
+    ofstream out(statsPath.c_str());
+    stats.writeJson(out);
+    out << endl;
+}
+
+template<class Stats>
+static Result runCoverTree(const Dataset& data) {
+    Result r;
+    r.startRss = currentRss();
+    vector<CountedPoint> points;
+    for (size_t i = 0; i < data.points.size(); i++) points.push_back(CountedPoint(data.points[i]));
+    evaluations = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    CoverTree<CountedPoint, ratio<2>, Stats> tree(points);
+    r.buildSeconds = microsecondsSince(start) / 1e6;
+    r.buildEvaluations = evaluations;
+
+    typename CoverTree<CountedPoint, ratio<2>, Stats>::QueryContext context;
+    r.queryEvaluations = 0;
+    r.wrong = 0;
+    for (size_t i = 0; i < data.queries.size(); i++) {
+        CountedPoint q(data.queries[i]);
+        evaluations = 0;
+        start = chrono::steady_clock::now();
+        const vector<const CountedPoint*>& found = tree.kNearestNeighbors(q, data.k, context);
+        r.latencies.push_back(microsecondsSince(start));
+        r.queryEvaluations += evaluations;
+        vector<double> dists;
+        for (size_t j = 0; j < found.size(); j++) {
+            dists.push_back(found[j]->CoverTreePoint::distance(q));
+        }
+        if (!matches(dists, data.answers[i])) r.wrong++;
+    }
+    writeStats(context.stats);
+    r.peakRss = peakRss();
+    return r;
+}
+
+// Langford's points are floats, padded with zeros to a multiple of 8 and
+// aligned to 16 bytes, as langford/point.cc's parse_points makes them.
+static point langfordPoint(const vector<double>& v) {
+    float* p;
+    if (posix_memalign((void**)&p, 16, point_len * sizeof(float)) != 0) abort();
+    for (int i = 0; i < point_len; i++) p[i] = i < (int)v.size() ? v[i] : 0.0f;
+    return p;
+}
+
+static Result runLangford(const Dataset& data) {
+    Result r;
+    r.startRss = currentRss();
+    point_len = (data.dim + 7) / 8 * 8;
+    v_array<point> points;
+    for (size_t i = 0; i < data.points.size(); i++) push(points, langfordPoint(data.points[i]));
+    evaluations = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    node top = batch_create(points);
+    r.buildSeconds = microsecondsSince(start) / 1e6;
+    r.buildEvaluations = evaluations;
+
+    r.queryEvaluations = 0;
+    r.wrong = 0;
+    for (size_t i = 0; i < data.queries.size(); i++) {
+        point q = langfordPoint(data.queries[i]);
+        node query = new_leaf(q);
+        v_array<v_array<point> > res;
+        evaluations = 0;
+        start = chrono::steady_clock::now();
+        k_nearest_neighbor(top, query, res, data.k);
+        r.latencies.push_back(microsecondsSince(start));
+        r.queryEvaluations += evaluations;
+        // res[0] is the query followed by its neighbors
+        vector<double> dists;
+        for (int j = 1; res.index > 0 && j < res[0].index; j++) {
+            vector<double> p(res[0][j], res[0][j] + data.dim);
+            vector<double> qd(q, q + data.dim);
+            dists.push_back(euclidean(p, qd));
+        }
+        if (!matches(dists, data.answers[i])) r.wrong++;
+        for (int j = 0; j < res.index; j++) free(res[j].elements);
+        free(res.elements);
+        free(q);
+    }
+    r.peakRss = peakRss();
+    return r;
+}
+
+static double percentile(const vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i];
+}
+
+// Prints one row of the recall table for each epsilon.
+static void runRecall(const Dataset& data, const vector<double>& epsilons) {
+    vector<CountedPoint> points;
+    for (size_t i = 0; i < data.points.size(); i++) points.push_back(CountedPoint(data.points[i]));
+    CoverTree<CountedPoint> tree(points);
+    CoverTree<CountedPoint>::QueryContext context;
+    cout << "epsilon\trecall\tmax_ratio\tdists_per_query\tp50_us\tp90_us\tp99_us\t"
+         << "queries_per_s\n";
+    for (size_t e = 0; e < epsilons.size(); e++) {
+        vector<double> latencies;
+        double recall = 0, maxRatio = 1, total = 0;
+        evaluations = 0;
+        for (size_t i = 0; i < data.queries.size(); i++) {
+            CountedPoint q(data.queries[i]);
+            chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            const vector<const CountedPoint*>& found =
+                tree.kNearestNeighbors(q, data.k, context, epsilons[e]);
+            latencies.push_back(microsecondsSince(start));
+            total += latencies.back();
+            const vector<double>& answer = data.answers[i];
+            if (answer.empty()) continue;
+            vector<double> dists;
+            for (size_t j = 0; j < found.size(); j++) {
+                dists.push_back(found[j]->CoverTreePoint::distance(q));
+            }
+            sort(dists.begin(), dists.end());
+            // as in matches, allowing for rounding in the .query file
+            double kth = answer.back() * (1 + 1e-5) + 1e-8;
+            size_t hits = 0;
+            for (size_t j = 0; j < dists.size() && j < answer.size(); j++) {
+                if (dists[j] <= kth) hits++;
+            }
+            recall += (double)hits / answer.size();
+            if (dists.size() >= answer.size() && answer.back() > 0) {
+                maxRatio = max(maxRatio, dists[answer.size() - 1] / answer.back());
+            }
+        }
+        sort(latencies.begin(), latencies.end());
+        size_t queries = max<size_t>(1, data.queries.size());
+        cout << epsilons[e] << "\t" << fixed << setprecision(4)
+             << recall / queries << "\t" << maxRatio << "\t"
+             << setprecision(1) << (double)evaluations / queries << "\t"
+             << setprecision(2) << percentile(latencies, 0.5) << "\t"
+             << percentile(latencies, 0.9) << "\t"
+             << percentile(latencies, 0.99) << "\t"
+             << setprecision(0) << queries / (total / 1e6) << endl;
+        cout.unsetf(ios::floatfield);
+        cout << setprecision(6);
+    }
+}
+
+static void printResult(const char* engine, const Dataset& data, Result r) {
+    sort(r.latencies.begin(), r.latencies.end());
+    size_t queries = max<size_t>(1, data.queries.size());
+    cout << engine << "\t" << data.points.size() << "\t" << data.dim << "\t"
+         << data.k << "\t" << data.queries.size() << "\t"
+         << fixed << setprecision(4) << r.buildSeconds << "\t"
+         << r.buildEvaluations << "\t"
+         << setprecision(1) << (double)r.queryEvaluations / queries << "\t"
+         << setprecision(2) << percentile(r.latencies, 0.5) << "\t"
+         << percentile(r.latencies, 0.9) << "\t"
+         << percentile(r.latencies, 0.99) << "\t"
+         << (r.latencies.empty() ? 0 : r.latencies.back()) << "\t"
+         << r.startRss << "\t" << r.peakRss << "\t" << r.wrong << endl;
+}
+
+// Runs one engine in a child process and waits for it.
+static void runSeparately(const char* engine, const Dataset& data,
+                          Result (*run)(const Dataset&)) {
+    cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        printResult(engine, data, run(data));
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cerr << engine << " failed" << endl;
+    }
+}
+
+static void usage(const char* name) {
+    cerr << "Usage: " << name << " [--k K] [--queries Q] [--engine both|covertree|langford]\n"
+         << "       [--stats FILE] [--epsilon E1,E2,...]\n"
+         << "       (--uniform N D [--seed S] | data.point)" << endl;
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    Dataset data;
+    data.k = 10;
+    data.dim = 0;
+    size_t numQueries = 1000, uniformPoints = 0;
+    unsigned int seed = 1;
+    string engine = "both", path;
+    vector<double> epsilons;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--k" && i + 1 < argc) data.k = atoi(argv[++i]);
+        else if (arg == "--queries" && i + 1 < argc) numQueries = atol(argv[++i]);
+        else if (arg == "--engine" && i + 1 < argc) engine = argv[++i];
+        else if (arg == "--seed" && i + 1 < argc) seed = atoi(argv[++i]);
+        else if (arg == "--stats" && i + 1 < argc) statsPath = argv[++i];
+        else if (arg == "--epsilon" && i + 1 < argc) {
+            for (char* e = strtok(argv[++i], ","); e != NULL; e = strtok(NULL, ",")) {
+                epsilons.push_back(atof(e));
+            }
+        }
+        else if (arg == "--uniform" && i + 2 < argc) {
+            uniformPoints = atol(argv[++i]);
+            data.dim = atoi(argv[++i]);
+        }
+        else if (path.empty() && arg[0] != '-') path = arg;
+        else usage(argv[0]);
+    }
+    if ((path.empty() == (uniformPoints == 0)) || data.k == 0) usage(argv[0]);
+
+    srand(seed);
+    if (uniformPoints > 0) {
+        data.name = "uniform";
+        for (size_t i = 0; i < uniformPoints + numQueries; i++) {
+            vector<double> row;
+            for (unsigned int j = 0; j < data.dim; j++) row.push_back((double)rand() / RAND_MAX);
+            (i < uniformPoints ? data.points : data.queries).push_back(row);
+        }
+    } else {
+        data.name = path;
+        PointRows rows;
+        if (!loadPointFile(path, rows, 0) || rows.size() == 0) {
+            cerr << "Unable to read points from " << path << endl;
+            exit(1);
+        }
+        for (size_t i = 0; i < rows.size(); i++) {
+            data.dim = max<unsigned int>(data.dim, rows.rowSize(i));
+        }
+        data.points = toRows(rows, 0, rows.size(), data.dim);
+        string queryPath = path.substr(0, path.rfind(".point")) + ".query";
+        if (path.size() > 6 && path.compare(path.size() - 6, 6, ".point") == 0
+            && readQueries(queryPath, data)) {
+            data.name += " (answers from " + queryPath + ")";
+        } else {
+            // uniform over the bounding box of the points
+            vector<double> lo(data.points[0]), hi(data.points[0]);
+            for (size_t i = 0; i < data.points.size(); i++) {
+                for (unsigned int j = 0; j < data.dim; j++) {
+                    lo[j] = min(lo[j], data.points[i][j]);
+                    hi[j] = max(hi[j], data.points[i][j]);
+                }
+            }
+            for (size_t i = 0; i < numQueries; i++) {
+                vector<double> row;
+                for (unsigned int j = 0; j < data.dim; j++) {
+                    row.push_back(lo[j] + (hi[j] - lo[j]) * rand() / RAND_MAX);
+                }
+                data.queries.push_back(row);
+            }
+        }
+    }
+    if (data.answers.empty()) bruteForceAnswers(data);
+
+    cout << "# " << data.name << "\n";
+    if (!epsilons.empty()) {
+        cout << "# " << data.points.size() << " points, " << data.dim << " dimensions, k="
+             << data.k << ", " << data.queries.size() << " queries\n";
+        runRecall(data, epsilons);
+        return 0;
+    }
+    cout << "engine\tpoints\tdim\tk\tqueries\tbuild_s\tbuild_dists\tdists_per_query\t"
+         << "p50_us\tp90_us\tp99_us\tmax_us\tstart_rss_kb\tpeak_rss_kb\twrong\n";
+    if (engine == "both" || engine == "covertree") {
+        runSeparately("covertree", data, statsPath.empty() ? runCoverTree<NoStats>
+                                                          : runCoverTree<OperationStats>);
+    }
+    if (engine == "both" || engine == "langford") runSeparately("langford", data, runLangford);
+    return 0;
+}
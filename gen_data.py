@@ -51,7 +51,7 @@ def make_ball(center, radius, level):
 	the ball. If level is 1, will just populate the ball with random points.
 	Returns a list of (x, y) tuples representing the points generated.
 	"""
-	if level is 1:
+	if level == 1:
 		# we bottomed out the recursion, let's get some points
 		points = []
 		while len(points) < NUM_SUBBALLS:
@@ -135,7 +135,7 @@ def write_to_file(points, queries):
 	"""
 
 	base_file = "./test_data/" + str(uuid.uuid4())
-	if len(sys.argv) is 2:
+	if len(sys.argv) == 2:
 		base_file = "./test_data/" + sys.argv[1]
 		
 	point_file = open(base_file + ".point", 'w')
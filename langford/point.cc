@@ -138,6 +138,7 @@ v_array<point > parse_points(FILE *input)
   	  } else if (c == '\n') {
   	      ungetc(c,input);
       }
+    }
 
 
 
@@ -2,127 +2,230 @@
 // GNU GPL'd
 
 // This code generates a cover tree from the dataset passed in as a command-line
-// parameter, and gathers statistics about the structure of the tree. Or at least,
-// that's what it WILL do...
+// parameter, and gathers statistics about the structure of the tree: how many
+// nodes each level holds, how many children nodes have, how deep and tall the
+// tree is, how many points share a node, how much memory it takes and how long
+// it took to build. Usage:
+//
+//   statistics [--csv | --json] [--threads N] datafile
+//
+// Without --csv or --json the statistics are printed for people to read. The
+// CSV has one "metric,key,value" row per number; in the JSON each histogram
+// is an array indexed by the value it counts.
 
 #include "Cover_Tree.h"
 #include "Cover_Tree_Point.h"
+#include "Cover_Tree_Loader.h"
 
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <cstdlib>
+#include <chrono>
 
 using namespace std;
 
-// Reads in the file, and creates CoverTreePoints from its contents. The file 
-// must be formatted as follows:
-//  - Lines beginning with a "#" will be ignored
-//  - One point per line
-//  - Points line in n-dimensional euclidean space
-//  - Lines must be numbers (floating-point or integer) delimited by any non-number
-//    and non-decimal characters
-//  - The nth number of each line defines that point's position on the nth axis
-//
-// Returns a vector<CoverTreePoint> representing all the points in the file.
-vector<CoverTreePoint> *parse_points(ifstream& f);
+// Reads in the file (see loadPointFile in Cover_Tree_Loader.h for the format),
+// and creates CoverTreePoints from its contents. Returns NULL if the file
+// can't be read.
+vector<CoverTreePoint> *parse_points(const char *path);
 
-// Returns whether the passed character is "okay", i.e. whether it represents
-// the start of a number we should process instead of throwing away
-static bool keepIterating(char c);
+typedef CoverTree<CoverTreePoint>::Statistics Statistics;
 
-// Takes in a vector of CoverTreePoints, and returns a double that is greater
-// than or equal to the maximum distance between any two of the points.
-static double getMaxDist(vector<CoverTreePoint> *vec);
+// Everything we report, besides the shape of the tree itself.
+struct Run {
+	size_t points;
+	unsigned int threads;
+	double loadSeconds;
+	double buildSeconds;
+};
+
+// Print the statistics for people, as CSV rows or as one JSON object.
+static void printText(const Run& run, const Statistics& s);
+static void printCsv(const Run& run, const Statistics& s);
+static void printJson(const Run& run, const Statistics& s);
+
+static double secondsSince(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
 
 int main(int argc, char **argv) {
-	if (argc != 2) {
+	enum { TEXT, CSV, JSON } format = TEXT;
+	Run run;
+	run.threads = 1;
+	const char *path = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--csv") == 0) {
+			format = CSV;
+		} else if (strcmp(argv[i], "--json") == 0) {
+			format = JSON;
+		} else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+			run.threads = atoi(argv[++i]);
+		} else if (path == NULL && argv[i][0] != '-') {
+			path = argv[i];
+		} else {
+			path = NULL;
+			break;
+		}
+	}
+	if (path == NULL) {
 		cout << "Put in a data file! Noob." << endl;
+		cout << "Usage: " << argv[0] << " [--csv | --json] [--threads N] datafile" << endl;
 		exit(1);
 	}
 
-	// Let's try to open the file
-	ifstream dataFile(argv[1]);
-	if (!dataFile.is_open()) {
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	vector<CoverTreePoint> *vec = parse_points(path);
+	if (vec == NULL) {
 		// Something went wrong! Crash
 		cerr << "Unable to open file! Exiting." << endl;
-		dataFile.close();
-		exit(1);	
+		exit(1);
 	}
+	run.loadSeconds = secondsSince(start);
+	run.points = vec->size();
+
+	start = chrono::steady_clock::now();
+	CoverTree<CoverTreePoint> *tree =
+		new CoverTree<CoverTreePoint>(*vec, run.threads);
+	run.buildSeconds = secondsSince(start);
+
+	Statistics s = tree->statistics();
+	if (format == CSV) {
+		printCsv(run, s);
+	} else if (format == JSON) {
+		printJson(run, s);
+	} else {
+		printText(run, s);
+	}
+	delete tree;
+	delete vec;
+	return 0;
+}
 
-	vector<CoverTreePoint> *vec = parse_points(dataFile);
-	dataFile.close();
-
-	double maxDist = getMaxDist(vec);
-
-	cout << "MaxDist: " << maxDist << endl;
+// The mean of a histogram, i.e. the mean of the values it counts.
+static double mean(const vector<unsigned int>& counts) {
+	double sum = 0, n = 0;
+	for (size_t v = 0; v < counts.size(); v++) {
+		sum += (double)v * counts[v];
+		n += counts[v];
+	}
+	return n == 0 ? 0 : sum / n;
+}
 
-	CoverTree<CoverTreePoint> *tree = new CoverTree<CoverTreePoint>(maxDist, *vec);
+static double bytesPerNode(const Statistics& s) {
+	return s.nodes == 0 ? 0 : (double)s.bytes / s.nodes;
+}
 
-	// Now process the data somehow
-	// That part's important...
+static void printHistogram(const char *name, const vector<unsigned int>& counts) {
+	cout << name << " (mean " << mean(counts) << "):" << endl;
+	for (size_t v = 0; v < counts.size(); v++) {
+		if (counts[v] > 0) {
+			cout << "  " << v << "\t" << counts[v] << endl;
+		}
+	}
+}
 
+static void printText(const Run& run, const Statistics& s) {
+	cout << "Points: " << run.points << endl;
+	cout << "Load time: " << run.loadSeconds << "s" << endl;
+	cout << "Build time: " << run.buildSeconds << "s (" << run.threads
+	     << " threads)" << endl;
+	cout << "Nodes: " << s.nodes << endl;
+	cout << "Levels: " << s.maxLevel << " to " << s.minLevel << endl;
+	cout << "Memory: " << s.bytes << " bytes, " << bytesPerNode(s)
+	     << " per node" << endl;
+	cout << "level\tnodes\tparents\tmean fan-out" << endl;
+	for (size_t i = 0; i < s.levelNodes.size(); i++) {
+		// the children at this level are the nodes one level down
+		unsigned int children = i + 1 < s.levelNodes.size() ? s.levelNodes[i+1] : 0;
+		cout << s.maxLevel - (int)i << "\t" << s.levelNodes[i] << "\t"
+		     << s.levelParents[i] << "\t"
+		     << (s.levelParents[i] ? (double)children / s.levelParents[i] : 0)
+		     << endl;
+	}
+	printHistogram("Children per node", s.fanOut);
+	printHistogram("Depth", s.depths);
+	printHistogram("Height", s.heights);
+	printHistogram("Points per node", s.pointsPerNode);
 }
 
-vector<CoverTreePoint> *parse_points(ifstream& f) {
-	vector<CoverTreePoint> *p = new vector<CoverTreePoint>;  // to return
-	vector<double> point;  // to point to the point before we push it on the vector
-	double d;  // to hold the new coordinate
-	string line;  // to hold the line we just read
-	size_t parsed;  // to hold how far in the string we parsed
-
-	// Now read until we're done
-	while(!f.eof()) {
-
-		// get the next line
-		getline(f, line);
-
-		// make "point" empty so it's actually a new point
-		point = vector<double>();
-
-		// Iterate through all the things in the string (arbitrary sequences of
-		// characters with some doubles thrown in)
-		while (!line.empty()) {
-			while (keepIterating(line.at(0))) {
-				// cut off the first character until it's something we want
-				line = line.substr(1);
-			}
-
-			// we're possibly at the end of the file
-			if (line.at(0) != '\n' && line.at(0) != EOF) {
-				// Now we've cut off the crap at the front, and can actually get a double
-				d = std::stod(line, &parsed);
-
-				// And move forward in our string
-				line = line.substr(parsed);
-
-				// And stick in on our vector
-				point.push_back(d);
-			}
-		}
+static void printCsvHistogram(const char *name, const vector<unsigned int>& counts) {
+	for (size_t v = 0; v < counts.size(); v++) {
+		cout << name << "," << v << "," << counts[v] << "\n";
+	}
+}
 
-		// Now put our beautiful new point onto our points vector
-		p->push_back(CoverTreePoint(point, 'a'));
+static void printCsv(const Run& run, const Statistics& s) {
+	cout << "metric,key,value\n";
+	cout << "summary,points," << run.points << "\n";
+	cout << "summary,load_seconds," << run.loadSeconds << "\n";
+	cout << "summary,build_seconds," << run.buildSeconds << "\n";
+	cout << "summary,threads," << run.threads << "\n";
+	cout << "summary,nodes," << s.nodes << "\n";
+	cout << "summary,max_level," << s.maxLevel << "\n";
+	cout << "summary,min_level," << s.minLevel << "\n";
+	cout << "summary,bytes," << s.bytes << "\n";
+	cout << "summary,bytes_per_node," << bytesPerNode(s) << "\n";
+	for (size_t i = 0; i < s.levelNodes.size(); i++) {
+		cout << "level_nodes," << s.maxLevel - (int)i << "," << s.levelNodes[i] << "\n";
+	}
+	for (size_t i = 0; i < s.levelParents.size(); i++) {
+		cout << "level_parents," << s.maxLevel - (int)i << "," << s.levelParents[i] << "\n";
+	}
+	printCsvHistogram("fan_out", s.fanOut);
+	printCsvHistogram("depth", s.depths);
+	printCsvHistogram("height", s.heights);
+	printCsvHistogram("points_per_node", s.pointsPerNode);
+	cout.flush();
+}
 
+static void printJsonArray(const vector<unsigned int>& counts) {
+	cout << "[";
+	for (size_t v = 0; v < counts.size(); v++) {
+		cout << (v ? ", " : "") << counts[v];
 	}
-	
-	return p;
+	cout << "]";
 }
 
-static bool keepIterating(char c) {
-	return c != '0' && c != '1' && c != '2' && c != '3' 
-  		 && c != '4' && c != '5' && c != '6' && c != '7' 
-  		 && c != '8' && c != '9' && c != '\n' && c != EOF && c != '-';
+static void printJson(const Run& run, const Statistics& s) {
+	cout << "{\n";
+	cout << "  \"points\": " << run.points << ",\n";
+	cout << "  \"load_seconds\": " << run.loadSeconds << ",\n";
+	cout << "  \"build_seconds\": " << run.buildSeconds << ",\n";
+	cout << "  \"threads\": " << run.threads << ",\n";
+	cout << "  \"nodes\": " << s.nodes << ",\n";
+	cout << "  \"max_level\": " << s.maxLevel << ",\n";
+	cout << "  \"min_level\": " << s.minLevel << ",\n";
+	cout << "  \"bytes\": " << s.bytes << ",\n";
+	cout << "  \"bytes_per_node\": " << bytesPerNode(s) << ",\n";
+	cout << "  \"level_nodes\": ";
+	printJsonArray(s.levelNodes);
+	cout << ",\n  \"level_parents\": ";
+	printJsonArray(s.levelParents);
+	cout << ",\n  \"fan_out\": ";
+	printJsonArray(s.fanOut);
+	cout << ",\n  \"depth\": ";
+	printJsonArray(s.depths);
+	cout << ",\n  \"height\": ";
+	printJsonArray(s.heights);
+	cout << ",\n  \"points_per_node\": ";
+	printJsonArray(s.pointsPerNode);
+	cout << "\n}" << endl;
 }
 
-static double getMaxDist(vector<CoverTreePoint> *vec) {
-	CoverTreePoint zeroPoint(vector<double>(), 'a');
-	double max = 0;
-	for (uint i = 0; i < vec->size(); i++) {
-		double dist = (*vec)[i].distance(zeroPoint);
-		if (max < dist) {
-			max = dist;
-		}
+vector<CoverTreePoint> *parse_points(const char *path) {
+	PointRows rows;
+	// use every core; the file is split at line breaks
+	if (!loadPointFile(path, rows, 0)) {
+		return NULL;
+	}
+	vector<CoverTreePoint> *p = new vector<CoverTreePoint>;  // to return
+	p->reserve(rows.size());
+	for (size_t i = 0; i < rows.size(); i++) {
+		vector<double> point(rows.row(i), rows.row(i) + rows.rowSize(i));
+		p->push_back(CoverTreePoint(point, 'a'));
 	}
-	return 2 * max;
-}
\ No newline at end of file
+	return p;
+}
@@ -1,9 +1,21 @@
 #include "Cover_Tree_Point.h"
 #include "Cover_Tree.h"
+#include "Cover_Tree_Concurrent.h"
+#include "Cover_Tree_Mapped.h"
+#include "Cover_Tree_Loader.h"
 
 #include <vector>
 #include <iostream>
 #include <cstdlib>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <ratio>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <chrono>
+#include <stdexcept>
 
 using namespace std;
 
@@ -106,6 +118,15 @@ void testTree() {
     if(cTree2.isValidTree()) cout << "500 random inserts test: \t\tPassed\n";
     else cout << "500 random inserts test: \t\tFailed\n";
 
+    //inserting points again must not add nodes or points
+    for(int i=0;i<100;i++) cTree2.insert(points[i]);
+    bool dupGood=cTree2.isValidTree();
+    for(int i=0;i<100;i++) {
+        if(cTree2.kNearestNeighbors(points[i],1).size()!=1) dupGood=false;
+    }
+    if(dupGood) cout << "Duplicate insert test: \t\t\tPassed\n";
+    else cout << "Duplicate insert test: \t\t\tFailed\n";
+
     bool NNGood=true;
     for(int i=0;i<100;i++) {
         vector<CoverTreePoint>
@@ -120,6 +141,844 @@ void testTree() {
     }
     if(cTree2.isValidTree()) cout << "Remove random test: \t\t\tPassed\n";
     else cout << "Remove random test: \t\t\tFailed\n";
+
+    //emptying the tree at once, then filling it again from reused nodes
+    cTree2.clear();
+    bool clearGood = cTree2.isValidTree() &&
+        cTree2.kNearestNeighbors(points[0],1).empty();
+    for(int i=0;i<100;i++) cTree2.insert(points[i]);
+    clearGood = clearGood && cTree2.isValidTree();
+    for(int i=0;i<100;i++) {
+        vector<CoverTreePoint> v = cTree2.kNearestNeighbors(points[i],1);
+        if(v.size()!=1 || !(v[0]==points[i])) clearGood=false;
+    }
+    if(clearGood) cout << "Clear test: \t\t\t\tPassed\n";
+    else cout << "Clear test: \t\t\t\tFailed\n";
+}
+
+//Returns the distances from p to its k nearest distinct points in points.
+vector<double> bruteKNN(const vector<CoverTreePoint>& points,
+                        const CoverTreePoint& p, unsigned int k) {
+    vector<CoverTreePoint> unique;
+    vector<double> dists;
+    for(unsigned int i=0;i<points.size();i++) {
+        if(find(unique.begin(),unique.end(),points[i])!=unique.end()) continue;
+        unique.push_back(points[i]);
+        dists.push_back(points[i].distance(p));
+    }
+    sort(dists.begin(),dists.end());
+    if(dists.size()>k) dists.resize(k);
+    return dists;
+}
+
+void testBatch() {
+    //clustered integer points, so there are plenty of duplicates and
+    //points with distance 0 but different names
+    vector<CoverTreePoint> points;
+    for(int i=0;i<1000;i++) {
+        vector<double> a;
+        for(int j=0;j<3;j++) a.push_back((rand()%2)*1000+rand()%6);
+        points.push_back(CoverTreePoint(a,'a'+rand()%3));
+    }
+    CoverTree<CoverTreePoint> cTree(2000,points);
+    if(cTree.isValidTree()) cout << "Batch construction test: \t\tPassed\n";
+    else cout << "Batch construction test: \t\tFailed\n";
+
+    bool kNNGood=true;
+    for(int i=0;i<200;i++) {
+        vector<CoverTreePoint> v = cTree.kNearestNeighbors(points[i],3);
+        vector<double> brute = bruteKNN(points,points[i],3);
+        for(unsigned int j=0;j<brute.size();j++) {
+            if(j>=v.size() || v[j].distance(points[i])!=brute[j]) kNNGood=false;
+        }
+    }
+    if(kNNGood) cout << "Batch construction KNN test: \t\tPassed\n";
+    else cout << "Batch construction KNN test: \t\tFailed\n";
+
+    //every distinct point within the radius, nearest first
+    bool rangeGood=true;
+    for(int i=0;i<100;i++) {
+        double r = (i%10)*1.5;
+        vector<CoverTreePoint> v = cTree.rangeSearch(points[i],r);
+        vector<double> brute = bruteKNN(points,points[i],points.size());
+        unsigned int within = 0;
+        while(within<brute.size() && brute[within]<=r) within++;
+        if(v.size()!=within) rangeGood=false;
+        for(unsigned int j=0;j<v.size() && rangeGood;j++) {
+            if(v[j].distance(points[i])!=brute[j]) rangeGood=false;
+        }
+    }
+    if(rangeGood) cout << "Range search test: \t\t\tPassed\n";
+    else cout << "Range search test: \t\t\tFailed\n";
+
+    //maxDist is much too small here; the batch build should still keep
+    //every point.
+    vector<CoverTreePoint> far;
+    vector<double> a(1,0.0);
+    for(int i=0;i<100;i++) {
+        a[0]=i*i;
+        far.push_back(CoverTreePoint(a,'a'));
+    }
+    CoverTree<CoverTreePoint> cTree2(1,far);
+    bool allFound=cTree2.isValidTree();
+    for(unsigned int i=0;i<far.size();i++) {
+        if(!(cTree2.kNearestNeighbors(far[i],1)[0]==far[i])) allFound=false;
+    }
+    if(allFound) cout << "Batch construction small maxDist test: \tPassed\n";
+    else cout << "Batch construction small maxDist test: \tFailed\n";
+
+    //the same construction spread over several threads, on enough points
+    //that subtrees are built by separate tasks
+    vector<CoverTreePoint> many;
+    for(int i=0;i<3000;i++) {
+        vector<double> a;
+        for(int j=0;j<3;j++) a.push_back((double)rand()/(double)RAND_MAX*100);
+        many.push_back(CoverTreePoint(a,'a'));
+    }
+    CoverTree<CoverTreePoint> cTree3(200,many,4);
+    bool parallelBuildGood=cTree3.isValidTree();
+    for(int i=0;i<100 && parallelBuildGood;i++) {
+        vector<CoverTreePoint> v = cTree3.kNearestNeighbors(many[i*29],3);
+        vector<double> brute = bruteKNN(many,many[i*29],3);
+        for(unsigned int j=0;j<brute.size();j++) {
+            if(j>=v.size() || v[j].distance(many[i*29])!=brute[j])
+                parallelBuildGood=false;
+        }
+    }
+    if(parallelBuildGood) cout << "Parallel batch construction test: \tPassed\n";
+    else cout << "Parallel batch construction test: \tFailed\n";
+
+    //queries clustered around a few centers, answered all at once
+    vector<CoverTreePoint> queries;
+    for(int i=0;i<300;i++) {
+        vector<double> a;
+        int center = rand()%4;
+        for(int j=0;j<3;j++) {
+            a.push_back(center*300+(double)rand()/(double)RAND_MAX*10);
+        }
+        queries.push_back(CoverTreePoint(a,'q'));
+    }
+    CoverTree<CoverTreePoint> queryTree(2000,queries);
+    vector<pair<CoverTreePoint, vector<CoverTreePoint> > >
+        results = cTree.kNearestNeighbors(queryTree,4);
+    bool batchNNGood = results.size()==queries.size();
+    for(unsigned int i=0;i<results.size();i++) {
+        vector<double> brute = bruteKNN(points,results[i].first,4);
+        for(unsigned int j=0;j<brute.size();j++) {
+            if(j>=results[i].second.size() ||
+               results[i].second[j].distance(results[i].first)!=brute[j])
+                batchNNGood=false;
+        }
+    }
+    if(batchNNGood) cout << "Batch nearest neighbor test: \t\tPassed\n";
+    else cout << "Batch nearest neighbor test: \t\tFailed\n";
+
+    //the same queries spread over several threads, answered in input order
+    vector<vector<CoverTreePoint> > parallel =
+        cTree.kNearestNeighborsBatch(queries,4,4);
+    bool parallelGood = parallel.size()==queries.size();
+    for(unsigned int i=0;i<parallel.size();i++) {
+        vector<CoverTreePoint> serial = cTree.kNearestNeighbors(queries[i],4);
+        if(parallel[i].size()!=serial.size()) parallelGood=false;
+        for(unsigned int j=0;j<serial.size() && parallelGood;j++) {
+            if(!(parallel[i][j]==serial[j])) parallelGood=false;
+        }
+    }
+    if(parallelGood) cout << "Multithreaded KNN test: \t\tPassed\n";
+    else cout << "Multithreaded KNN test: \t\tFailed\n";
+
+    //one context reused for every query gives the same answers, without
+    //copying the points
+    CoverTree<CoverTreePoint>::QueryContext context;
+    bool contextGood = true;
+    for(unsigned int i=0;i<queries.size();i++) {
+        vector<CoverTreePoint> serial = cTree.kNearestNeighbors(queries[i],4);
+        const vector<const CoverTreePoint*>& found =
+            cTree.kNearestNeighbors(queries[i],4,context);
+        if(found.size()!=serial.size()) contextGood=false;
+        for(unsigned int j=0;j<serial.size() && contextGood;j++) {
+            if(!(*found[j]==serial[j])) contextGood=false;
+        }
+    }
+    if(contextGood) cout << "Reused query context test: \t\tPassed\n";
+    else cout << "Reused query context test: \t\tFailed\n";
+}
+
+void testBoundedDistance() {
+    bool good = HasBoundedDistance<CoverTreePoint>::value;
+    for(int i=0;i<100;i++) {
+        vector<double> a, b;
+        for(int j=0;j<100+i;j++) a.push_back((double)rand()/(double)RAND_MAX);
+        for(int j=0;j<100;j++) b.push_back((double)rand()/(double)RAND_MAX);
+        CoverTreePoint p(a,'a'), q(b,'a');
+        double exact = p.distance(q);
+        //exact whenever the distance is within the bound...
+        if(p.distance(q,exact)!=exact || q.distance(p,exact*2)!=exact) good=false;
+        //...and only guaranteed to be above the bound otherwise
+        if(!(p.distance(q,exact/3) > exact/3)) good=false;
+    }
+    if(good) cout << "Bounded distance test: \t\t\tPassed\n";
+    else cout << "Bounded distance test: \t\t\tFailed\n";
+}
+
+void testDistanceKernels() {
+    vector<DistanceKernel> kernels = supportedDistanceKernels();
+    bool good = true;
+    for(unsigned int n=0;n<300;n+=7) {
+        vector<double, AlignedAllocator<double> > a(n+1), b(n+1);
+        vector<float, AlignedAllocator<float> > af(n+1), bf(n+1);
+        for(unsigned int j=0;j<=n;j++) {
+            af[j] = a[j] = (double)rand()/(double)RAND_MAX;
+            bf[j] = b[j] = (double)rand()/(double)RAND_MAX;
+        }
+        //start one past the aligned address too, so unaligned loads are used
+        for(unsigned int off=0;off<2 && off<=n;off++) {
+            unsigned int m = n-off;
+            double exact = kernels[0].squaredDistance(&a[off],&b[off],m,HUGE_VAL);
+            float exactf = kernels[0].squaredDistanceFloat(&af[off],&bf[off],m,HUGE_VALF);
+            for(unsigned int k=0;k<kernels.size();k++) {
+                double d = kernels[k].squaredDistance(&a[off],&b[off],m,HUGE_VAL);
+                float f = kernels[k].squaredDistanceFloat(&af[off],&bf[off],m,HUGE_VALF);
+                if(fabs(d-exact) > 1e-9*(1+exact)) good=false;
+                if(fabs(f-exactf) > 1e-4*(1+exactf)) good=false;
+                if(exact > 0 && !(kernels[k].squaredDistance(&a[off],&b[off],m,exact/3) > exact/3)) good=false;
+            }
+        }
+    }
+    if(good) cout << "Distance kernel test: \t\t\tPassed\n";
+    else cout << "Distance kernel test: \t\t\tFailed\n";
+}
+
+void testConcurrent() {
+    //fixed points which are never removed, and points which come and go
+    vector<CoverTreePoint> fixed, moving;
+    for(int i=0;i<200;i++) {
+        vector<double> a, b;
+        for(int j=0;j<3;j++) {
+            a.push_back((double)rand()/(double)RAND_MAX);
+            b.push_back((double)rand()/(double)RAND_MAX);
+        }
+        fixed.push_back(CoverTreePoint(a,'f'));
+        moving.push_back(CoverTreePoint(b,'m'));
+    }
+    ConcurrentCoverTree<CoverTreePoint> cTree(10,fixed);
+
+    //every fixed point must always be its own nearest neighbor, whatever
+    //the writer is doing
+    atomic<bool> writing(true), readsGood(true);
+    vector<thread> readers;
+    for(int r=0;r<3;r++) {
+        readers.push_back(thread([&]() {
+            unsigned int i = 0;
+            do {
+                const CoverTreePoint& p = fixed[i++%fixed.size()];
+                vector<CoverTreePoint> nn = cTree.kNearestNeighbors(p,1);
+                if(nn.empty() || nn[0].distance(p)!=0.0) readsGood=false;
+            } while(writing || i < fixed.size());
+        }));
+    }
+    for(int round=0;round<3;round++) {
+        for(unsigned int i=0;i<moving.size();i++) cTree.insert(moving[i]);
+        for(unsigned int i=0;i<moving.size();i+=2) cTree.remove(moving[i]);
+    }
+    writing=false;
+    for(unsigned int r=0;r<readers.size();r++) readers[r].join();
+
+    bool good = readsGood && cTree.isValidTree();
+    vector<CoverTreePoint> all(fixed);
+    for(unsigned int i=1;i<moving.size();i+=2) all.push_back(moving[i]);
+    for(unsigned int i=0;i<moving.size();i++) {
+        vector<double> brute = bruteKNN(all,moving[i],3);
+        vector<CoverTreePoint> found = cTree.kNearestNeighbors(moving[i],3);
+        for(unsigned int j=0;j<brute.size();j++) {
+            if(j>=found.size() || found[j].distance(moving[i])!=brute[j]) good=false;
+        }
+    }
+    if(good) cout << "Concurrent read/write test: \t\tPassed\n";
+    else cout << "Concurrent read/write test: \t\tFailed\n";
+}
+
+void testBase() {
+    //Langford's base; the tree has more levels, each with tighter radii
+    typedef CoverTree<CoverTreePoint, ratio<13,10> > Tree13;
+    vector<CoverTreePoint> points, more;
+    for(int i=0;i<1000;i++) {
+        vector<double> a, b;
+        for(int j=0;j<3;j++) {
+            a.push_back((double)rand()/(double)RAND_MAX*10);
+            b.push_back((double)rand()/(double)RAND_MAX*10);
+        }
+        points.push_back(CoverTreePoint(a,'a'));
+        more.push_back(CoverTreePoint(b,'b'));
+    }
+    Tree13 cTree(20,points);
+    bool good = cTree.isValidTree();
+    for(unsigned int i=0;i<more.size();i++) cTree.insert(more[i]);
+    good = good && cTree.isValidTree();
+    for(unsigned int i=0;i<points.size();i+=2) cTree.remove(points[i]);
+    good = good && cTree.isValidTree();
+    vector<CoverTreePoint> all(more);
+    for(unsigned int i=1;i<points.size();i+=2) all.push_back(points[i]);
+    for(unsigned int i=0;i<200;i++) {
+        vector<double> brute = bruteKNN(all,points[i],3);
+        vector<CoverTreePoint> v = cTree.kNearestNeighbors(points[i],3);
+        for(unsigned int j=0;j<brute.size();j++) {
+            if(j>=v.size() || v[j].distance(points[i])!=brute[j]) good=false;
+        }
+    }
+    if(good) cout << "Base 1.3 test: \t\t\t\tPassed\n";
+    else cout << "Base 1.3 test: \t\t\t\tFailed\n";
+}
+
+/**
+ * Writes, with a good checksum, the points 0, 2 and 1 linked by links:
+ * each (parent, level, child) hangs node child from node parent at level,
+ * and a negative parent ends the list.
+ */
+string craftTree(const int* links) {
+    //the magic number, version and base, as save writes them
+    stringstream empty;
+    CoverTree<CoverTreePoint>(1).save(empty);
+    stringstream out;
+    ChecksumBuf buf(out.rdbuf());
+    ostream body(&buf);
+    body.write(empty.str().data(), 24);
+    writeValue(body, (int32_t)2);
+    writeValue(body, (int32_t)-1);
+    writeValue(body, (uint32_t)3);
+    const double at[] = {0, 2, 1};
+    for(int i=0;i<3;i++) {
+        writeValue(body, (uint32_t)1);
+        CoverTreePoint(vector<double>(1,at[i]),'a').save(body);
+    }
+    for(int i=0;i<3;i++) {
+        uint32_t numChildren=0;
+        for(int j=0;links[j]>=0;j+=3) if(links[j]==i) numChildren++;
+        writeValue(body, numChildren);
+        for(int j=0;links[j]>=0;j+=3) {
+            if(links[j]!=i) continue;
+            writeValue(body, (int32_t)links[j+1]);
+            writeValue(body, (uint32_t)links[j+2]);
+            writeValue(body, fabs(at[i]-at[links[j+2]]));
+        }
+    }
+    body.flush();
+    writeValue(out, buf.sum());
+    return out.str();
+}
+
+void testSerialize() {
+    vector<CoverTreePoint> points;
+    for(int i=0;i<1000;i++) {
+        vector<double> a;
+        for(int j=0;j<5;j++) a.push_back((double)rand()/(double)RAND_MAX*10);
+        points.push_back(CoverTreePoint(a,'a'));
+        //a few points sharing a node
+        if(i%100==0) points.push_back(CoverTreePoint(a,'b'));
+    }
+    CoverTree<CoverTreePoint> cTree(50,points);
+    //leave some holes in the arena
+    for(unsigned int i=0;i<points.size();i+=7) cTree.remove(points[i]);
+    stringstream out;
+    bool good = cTree.save(out);
+    string saved = out.str();
+
+    istringstream in(saved);
+    CoverTree<CoverTreePoint> loaded(1);
+    good = good && loaded.load(in) && loaded.isValidTree();
+    for(unsigned int i=0;i<100;i++) {
+        vector<CoverTreePoint> a = cTree.kNearestNeighbors(points[i],4);
+        vector<CoverTreePoint> b = loaded.kNearestNeighbors(points[i],4);
+        if(!(a==b)) good=false;
+    }
+    //the loaded tree can be changed like any other
+    for(unsigned int i=0;i<points.size();i+=7) loaded.insert(points[i]);
+    for(unsigned int i=1;i<points.size();i+=2) loaded.remove(points[i]);
+    good = good && loaded.isValidTree();
+
+    //a flipped byte, a short read, or another base must all be refused
+    string corrupt = saved;
+    corrupt[corrupt.size()/2] ^= 1;
+    istringstream bad(corrupt), shortIn(saved.substr(0,saved.size()-1));
+    CoverTree<CoverTreePoint, ratio<3,2> > otherBase(1);
+    istringstream otherIn(saved);
+    if(loaded.load(bad) || loaded.getRoot()!=NULL) good=false;
+    if(loaded.load(shortIn) || otherBase.load(otherIn)) good=false;
+
+    //links which don't make a tree are refused even with a good checksum
+    const int chain[] = {0,1,1, 1,0,2, -1};
+    istringstream chainIn(craftTree(chain));
+    good = good && loaded.load(chainIn) && loaded.isValidTree();
+    //node 2 hung from two parents, and a cycle the root doesn't reach
+    const int shared[] = {0,1,1, 0,0,2, 1,0,2, -1};
+    const int cycle[] = {1,0,2, 2,-1,1, -1};
+    istringstream sharedIn(craftTree(shared)), cycleIn(craftTree(cycle));
+    if(loaded.load(sharedIn) || loaded.getRoot()!=NULL) good=false;
+    if(loaded.load(cycleIn) || loaded.getRoot()!=NULL) good=false;
+
+    //an empty tree round trips too
+    CoverTree<CoverTreePoint> empty(1);
+    stringstream emptyOut;
+    good = good && empty.save(emptyOut) && loaded.load(emptyOut)
+        && loaded.getRoot()==NULL && loaded.isValidTree();
+    if(good) cout << "Save and load test: \t\t\tPassed\n";
+    else cout << "Save and load test: \t\t\tFailed\n";
+}
+
+void testMapped() {
+    vector<CoverTreePoint> points;
+    for(int i=0;i<1000;i++) {
+        vector<double> a;
+        for(int j=0;j<5;j++) a.push_back((double)rand()/(double)RAND_MAX*10);
+        points.push_back(CoverTreePoint(a,'a'+i%26));
+        if(i%100==0) points.push_back(CoverTreePoint(a,'A'));
+    }
+    CoverTree<CoverTreePoint> cTree(50,points);
+    const char* path = "mapped_test.tree";
+    bool good;
+    {
+        ofstream out(path, ios::binary);
+        good = MappedCoverTree<>::write(cTree, out);
+    }
+    MappedCoverTree<> mapped;
+    good = good && mapped.open(path) && mapped.verify()
+        && mapped.size()==points.size() && mapped.dimension()==5;
+    for(unsigned int i=0;good && i<200;i++) {
+        const double* q = points[i].coordinates().data();
+        vector<CoverTreePoint> a = cTree.kNearestNeighbors(points[i],3);
+        vector<MappedCoverTree<>::Neighbor> b = mapped.kNearestNeighbors(q,3);
+        if(a.size()!=b.size()) good=false;
+        for(unsigned int j=0;good && j<a.size();j++) {
+            const double* p = mapped.point(b[j].second);
+            if(a[j].distance(points[i])!=b[j].first
+               || !(CoverTreePoint(vector<double>(p,p+5),
+                                   mapped.label(b[j].second))==a[j])) {
+                good=false;
+            }
+        }
+        vector<CoverTreePoint> c = cTree.rangeSearch(points[i],2);
+        if(c.size()!=mapped.rangeSearch(q,2).size()) good=false;
+    }
+    //a tree of another base is refused, and damage is caught by verify
+    MappedCoverTree<ratio<3,2> > otherBase;
+    if(otherBase.open(path)) good=false;
+    mapped.close();
+    //so is a header claiming billions of levels, before anything is sized
+    //by them
+    int32_t minLevel, hugeSpan = -2000000000;
+    {
+        fstream f(path, ios::binary|ios::in|ios::out);
+        f.seekg(28);
+        f.read(reinterpret_cast<char*>(&minLevel), sizeof(minLevel));
+        f.seekp(28);
+        f.write(reinterpret_cast<const char*>(&hugeSpan), sizeof(hugeSpan));
+    }
+    if(mapped.open(path)) good=false;
+    {
+        fstream f(path, ios::binary|ios::in|ios::out);
+        f.seekp(28);
+        f.write(reinterpret_cast<const char*>(&minLevel), sizeof(minLevel));
+        f.seekp(200);
+        f.put('x');
+    }
+    if(!mapped.open(path) || mapped.verify()) good=false;
+    mapped.close();
+    remove(path);
+    if(good) cout << "Memory-mapped tree test: \t\tPassed\n";
+    else cout << "Memory-mapped tree test: \t\tFailed\n";
+}
+
+void testLoader() {
+    //the quirks of the format, without a newline at the end
+    string text = "# a comment 1 2 3\n1, 2\r\n\n-3.5 4e2 x .25\n"
+        "7;-0.001E-3 1e 6\n#\n+8\t9e+1";
+    double expected[][4] = {{1,2}, {-3.5,400,0.25}, {7,-0.001e-3,1,6}, {8,90}};
+    unsigned int sizes[] = {2, 3, 4, 2};
+    PointRows rows;
+    parsePoints(text.data(), text.data()+text.size(), rows);
+    bool good = rows.size()==4;
+    for(unsigned int i=0;good && i<4;i++) {
+        if(rows.rowSize(i)!=sizes[i]) good=false;
+        for(unsigned int j=0;good && j<sizes[i];j++) {
+            if(rows.row(i)[j]!=expected[i][j]) good=false;
+        }
+    }
+    //numbers of every shape must come out exactly as strtod makes them,
+    //whether the file is read on one thread or several
+    const char* path = "loader_test.point";
+    vector<vector<double> > written;
+    {
+        ofstream out(path);
+        char buf[64];
+        for(int i=0;i<20000;i++) {
+            vector<double> row;
+            for(int j=0;j<3;j++) {
+                double d = ((double)rand()/RAND_MAX-0.5)*pow(10.0,rand()%40-20);
+                snprintf(buf, sizeof(buf), "%.*g", 1+rand()%17, d);
+                row.push_back(strtod(buf, NULL));
+                out << buf << (j<2 ? ", " : "\n");
+            }
+            written.push_back(row);
+        }
+    }
+    for(unsigned int threads=1;threads<=4;threads+=3) {
+        good = good && loadPointFile(path, rows, threads)
+            && rows.size()==written.size();
+        for(unsigned int i=0;good && i<rows.size();i++) {
+            if(!equal(written[i].begin(), written[i].end(), rows.row(i))
+               || rows.rowSize(i)!=3) {
+                good=false;
+            }
+        }
+    }
+    remove(path);
+    if(loadPointFile(path, rows) || rows.size()!=0) good=false;
+    if(good) cout << "Point file loader test: \t\tPassed\n";
+    else cout << "Point file loader test: \t\tFailed\n";
+}
+
+void testStatistics() {
+    vector<CoverTreePoint> points;
+    for(int i=0;i<2000;i++) {
+        vector<double> a;
+        for(int j=0;j<3;j++) a.push_back((double)rand()/(double)RAND_MAX*10);
+        points.push_back(CoverTreePoint(a,'a'));
+        if(i%50==0) points.push_back(CoverTreePoint(a,'b'));
+    }
+    CoverTree<CoverTreePoint> cTree(20,points);
+    CoverTree<CoverTreePoint>::Statistics s = cTree.statistics();
+    //every node is counted once in each breakdown, every node but the
+    //root is someone's child, and every point is in some node
+    unsigned int levels=0, depths=0, heights=0, nodes=0, children=0, count=0;
+    for(unsigned int i=0;i<s.levelNodes.size();i++) levels += s.levelNodes[i];
+    for(unsigned int i=0;i<s.depths.size();i++) depths += s.depths[i];
+    for(unsigned int i=0;i<s.heights.size();i++) heights += s.heights[i];
+    for(unsigned int i=0;i<s.fanOut.size();i++) {
+        nodes += s.fanOut[i];
+        children += i*s.fanOut[i];
+    }
+    for(unsigned int i=0;i<s.pointsPerNode.size();i++) count += i*s.pointsPerNode[i];
+    bool good = s.nodes==2000 && levels==2000 && depths==2000 && heights==2000
+        && nodes==2000 && children==1999 && count==points.size()
+        && s.pointsPerNode[2]==40 && s.depths[0]==1
+        && s.heights.size()==s.depths.size() && s.bytes > 2000*sizeof(CoverTreePoint);
+    CoverTree<CoverTreePoint> empty(20);
+    s = empty.statistics();
+    good = good && s.nodes==0 && s.fanOut.empty() && s.bytes==0;
+    if(good) cout << "Statistics test: \t\t\tPassed\n";
+    else cout << "Statistics test: \t\t\tFailed\n";
+}
+
+//counts every distance computed, to check a tree's stats against
+static unsigned long distanceCount = 0;
+struct CountedPoint : public CoverTreePoint
+{
+    CountedPoint(const vector<double>& v, char name) : CoverTreePoint(v,name) {}
+    double distance(const CountedPoint& p) const {
+        distanceCount++;
+        return CoverTreePoint::distance(p);
+    }
+    double distance(const CountedPoint& p, double bound) const {
+        distanceCount++;
+        return CoverTreePoint::distance(p, bound);
+    }
+};
+
+void testOperationStats() {
+    typedef CoverTree<CountedPoint, ratio<2>, OperationStats> Tree;
+    vector<CountedPoint> points, more;
+    for(int i=0;i<1500;i++) {
+        vector<double> a;
+        for(int j=0;j<3;j++) a.push_back((double)rand()/(double)RAND_MAX*10);
+        if(i<1000) points.push_back(CountedPoint(a,'a'));
+        else more.push_back(CountedPoint(a,'a'));
+    }
+    Tree cTree(20,points);
+    //every distance the tree computes from here on is in its stats
+    distanceCount = 0;
+    for(unsigned int i=0;i<more.size();i++) cTree.insert(more[i]);
+    for(unsigned int i=0;i<100;i++) cTree.remove(points[i]);
+    //a batch which leaves the root alone, so it is a REMOVE_BATCH only
+    vector<CountedPoint> batch;
+    for(unsigned int i=100;i<140;i++) {
+        if(!cTree.getRoot()->hasPoint(points[i])) batch.push_back(points[i]);
+    }
+    cTree.removeBatch(batch);
+    for(unsigned int i=0;i<50;i++) {
+        cTree.kNearestNeighbors(more[i],3);
+        cTree.rangeSearch(more[i],0.5);
+    }
+    OperationStats stats = cTree.operationStats();
+    const OperationStats::Summary& inserts = stats.summary(INSERT);
+    const OperationStats::Summary& removes = stats.summary(REMOVE);
+    const OperationStats::Summary& knn = stats.summary(KNN_QUERY);
+    const OperationStats::Summary& range = stats.summary(RANGE_QUERY);
+    const OperationStats::Summary& batches = stats.summary(REMOVE_BATCH);
+    bool good = inserts.distances.count()==500 && removes.distances.count()==100
+        && knn.distances.count()==50 && range.distances.count()==50
+        && batches.distances.count()==1 && batches.distances.sum() > 0
+        && inserts.distances.sum()+removes.distances.sum()+knn.distances.sum()
+           +range.distances.sum()+batches.distances.sum()==distanceCount
+        && knn.coverSets.count()==knn.levels.sum()
+        && knn.touched.sum() > 0 && knn.pruned.sum() > 0
+        && inserts.distances.quantile(0.5) <= inserts.distances.max();
+    //queries through a context go to the context, batches to the tree
+    Tree::QueryContext context;
+    cTree.kNearestNeighbors(more[0],3,context);
+    cTree.kNearestNeighborsBatch(more,3,2);
+    stats = cTree.operationStats();
+    good = good && context.stats.summary(KNN_QUERY).distances.count()==1
+        && stats.summary(KNN_QUERY).distances.count()==50+more.size();
+    ostringstream json;
+    stats.writeJson(json);
+    good = good && json.str().find("\"range_query\": {")!=string::npos;
+    cTree.clearOperationStats();
+    good = good && cTree.operationStats().summary(INSERT).distances.count()==0;
+    //the paths which end before any search are counted too
+    Tree small;
+    small.insert(points[0]);
+    small.insert(points[0]);
+    small.remove(points[1]);
+    small.remove(points[0]);
+    small.remove(points[0]);
+    small.remove(points[0]);
+    //points in the root, even a new one, leave a batch through remove()
+    small.insert(points[0]);
+    small.insert(points[1]);
+    small.removeBatch(vector<CountedPoint>(points.begin(), points.begin()+2));
+    stats = small.operationStats();
+    good = good && stats.summary(INSERT).distances.count()==4
+        && stats.summary(REMOVE).distances.count()==6
+        && stats.summary(REMOVE_BATCH).distances.count()==1
+        && small.getRoot()==NULL;
+    if(good) cout << "Operation stats test: \t\t\tPassed\n";
+    else cout << "Operation stats test: \t\t\tFailed\n";
+}
+
+void testApproximate() {
+    vector<CountedPoint> points, queries;
+    for(int i=0;i<3000;i++) {
+        vector<double> a;
+        for(int j=0;j<6;j++) a.push_back((double)rand()/(double)RAND_MAX);
+        if(i<2800) points.push_back(CountedPoint(a,'a'));
+        else queries.push_back(CountedPoint(a,'a'));
+    }
+    CoverTree<CountedPoint> cTree(10,points);
+    const unsigned int k = 5;
+    double epsilons[] = {0.0, 0.5, 2.0};
+    unsigned long counts[3];
+    bool good = true;
+    for(int e=0;e<3;e++) {
+        distanceCount = 0;
+        vector<vector<CountedPoint> > found =
+            cTree.kNearestNeighborsBatch(queries, k, 1, epsilons[e]);
+        counts[e] = distanceCount;
+        for(unsigned int i=0;i<queries.size();i++) {
+            vector<double> exact, approx;
+            for(unsigned int j=0;j<points.size();j++) {
+                exact.push_back(queries[i].CoverTreePoint::distance(points[j]));
+            }
+            sort(exact.begin(), exact.end());
+            for(unsigned int j=0;j<found[i].size();j++) {
+                approx.push_back(queries[i].CoverTreePoint::distance(found[i][j]));
+            }
+            sort(approx.begin(), approx.end());
+            //the ith point found is within 1+epsilon of the true ith
+            good = good && approx.size() >= k;
+            for(unsigned int j=0;good && j<k;j++) {
+                good = approx[j] <= exact[j]*(1+epsilons[e]) + 1e-12
+                    && (epsilons[e] > 0 || approx[j] == exact[j]);
+            }
+        }
+    }
+    good = good && counts[1] < counts[0] && counts[2] < counts[1];
+    //in 64 dimensions the bounded distance stops after the first 32
+    //coordinates, so b's partial distance is under a's whole one
+    vector<double> zero(64,0.0), a(64,0.0), b(64,0.0);
+    a[0]=6.0;
+    b[0]=4.1;
+    b[40]=9.8;
+    CoverTree<CoverTreePoint> wide;
+    wide.insert(CoverTreePoint(a,'a'));
+    wide.insert(CoverTreePoint(b,'b'));
+    vector<CoverTreePoint> nearest = wide.kNearestNeighbors(CoverTreePoint(zero,'q'),1,0.5);
+    good = good && nearest.size()==1 && nearest[0]==CoverTreePoint(a,'a');
+    if(good) cout << "Approximate KNN test: \t\t\tPassed\n";
+    else cout << "Approximate KNN test: \t\t\tFailed\n";
+}
+
+//true iff tree holds exactly the points of expected (by ==)
+template<class Tree>
+bool holdsExactly(const Tree& tree, const vector<CoverTreePoint>& expected) {
+    if(!tree.isValidTree()) return false;
+    if(tree.statistics().points!=expected.size()) return false;
+    for(unsigned int i=0;i<expected.size();i++) {
+        vector<CoverTreePoint> at = tree.rangeSearch(expected[i],0.0);
+        if(find(at.begin(),at.end(),expected[i])==at.end()) return false;
+    }
+    return true;
+}
+
+void testRemoveBatch() {
+    //clustered points with duplicates under other names, so some nodes
+    //lose only some of their points; equal points are kept once, as the
+    //tree holds them once
+    vector<CoverTreePoint> points;
+    for(int i=0;i<3000;i++) {
+        vector<double> a;
+        for(int j=0;j<4;j++) a.push_back((double)(rand()%40)/4);
+        if(find(points.begin(),points.end(),CoverTreePoint(a,'a'))!=points.end()) continue;
+        points.push_back(CoverTreePoint(a,'a'));
+        if(i%10==0) points.push_back(CoverTreePoint(a,'b'));
+    }
+    CoverTree<CoverTreePoint> cTree(20);
+    for(unsigned int i=0;i<points.size();i++) cTree.insert(points[i]);
+    vector<CoverTreePoint> kept;
+    //a small batch, including the root (the first point inserted), repeats
+    //and points not in the tree
+    vector<CoverTreePoint> victims(1,points[0]);
+    for(unsigned int i=0;i<points.size();i++) {
+        if(i%7==3) victims.push_back(points[i]);
+        else if(i!=0) kept.push_back(points[i]);
+    }
+    victims.push_back(victims[5]);
+    vector<double> far(4,100.0);
+    victims.push_back(CoverTreePoint(far,'a'));
+    victims.push_back(CoverTreePoint(points[1].getVec(),'z'));
+    cTree.removeBatch(victims);
+    bool good = holdsExactly(cTree, kept);
+    //a large batch, which rebuilds what is left
+    victims.clear();
+    vector<CoverTreePoint> rest;
+    for(unsigned int i=0;i<kept.size();i++) {
+        if(i%3!=0) victims.push_back(kept[i]);
+        else rest.push_back(kept[i]);
+    }
+    cTree.removeBatch(victims);
+    good = good && holdsExactly(cTree, rest);
+    cTree.removeBatch(rest);
+    good = good && cTree.getRoot()==NULL && cTree.isValidTree();
+    //Langford's base, with a batch built tree
+    CoverTree<CoverTreePoint, ratio<13,10> > tree13(20, points);
+    victims.clear();
+    kept.clear();
+    for(unsigned int i=0;i<points.size();i++) {
+        if(i%5==1) victims.push_back(points[i]);
+        else kept.push_back(points[i]);
+    }
+    tree13.removeBatch(victims);
+    good = good && holdsExactly(tree13, kept);
+    if(good) cout << "Batch remove test: \t\t\tPassed\n";
+    else cout << "Batch remove test: \t\t\tFailed\n";
+}
+
+//counts the points alive, to see the tree let go of removed ones
+int livePoints = 0;
+struct LivePoint : public CoverTreePoint
+{
+    LivePoint(const vector<double>& v, char name) : CoverTreePoint(v,name) { livePoints++; }
+    LivePoint(const LivePoint& p) : CoverTreePoint(p) { livePoints++; }
+    LivePoint& operator=(const LivePoint& p) { CoverTreePoint::operator=(p); return *this; }
+    ~LivePoint() { livePoints--; }
+};
+
+void testReleased() {
+    bool good;
+    {
+        CoverTree<LivePoint> cTree;
+        vector<LivePoint> victims;
+        for(int i=0;i<200;i++) {
+            vector<double> a(2,(double)i);
+            LivePoint p(a,'a');
+            cTree.insert(p);
+            if(i%2) victims.push_back(p);
+        }
+        for(unsigned int i=0;i<victims.size()/2;i++) cTree.remove(victims[i]);
+        cTree.removeBatch(vector<LivePoint>(victims.begin()+victims.size()/2, victims.end()));
+        //the tree's 100 and the test's 100
+        good = livePoints==200 && cTree.statistics().points==100;
+        victims.clear();
+        cTree.clear();
+        good = good && livePoints==0;
+    }
+    good = good && livePoints==0;
+    if(good) cout << "Released points test: \t\t\tPassed\n";
+    else cout << "Released points test: \t\t\tFailed\n";
+}
+
+void testTaskPool() {
+    TaskPool pool(4);
+    atomic<int> finished(0);
+    bool caught = false;
+    try {
+        //the chunk run by this thread throws at once, the others take longer
+        pool.forEach(64, 8, [&finished](size_t i) {
+            if(i==0) throw runtime_error("first chunk");
+            if(i<8) return;
+            this_thread::sleep_for(chrono::milliseconds(1));
+            finished++;
+        });
+    } catch(const runtime_error&) {
+        caught = true;
+    }
+    if(caught && finished==56) cout << "Task pool exception test: \t\tPassed\n";
+    else cout << "Task pool exception test: \t\tFailed\n";
+}
+
+void testRootLevel() {
+    //each point lands farther out than all before it, on alternate sides,
+    //so the root has to rise for every one
+    vector<CoverTreePoint> points;
+    vector<double> a(1,0.0);
+    for(int i=0;i<30;i++) {
+        a[0]=(i%2 ? -1 : 1)*pow(1.7,i);
+        points.push_back(CoverTreePoint(a,'a'));
+        a[0]+=0.25;
+        points.push_back(CoverTreePoint(a,'a'));
+    }
+    CoverTree<CoverTreePoint> grown;
+    CoverTree<CoverTreePoint> padded(1e30);
+    for(unsigned int i=0;i<points.size();i++) {
+        grown.insert(points[i]);
+        padded.insert(points[i]);
+    }
+    bool good = holdsExactly(grown, points) && holdsExactly(padded, points);
+    //the root is at the highest level with anything else in it, however
+    //much room it was given
+    good = good && grown.statistics().maxLevel==padded.statistics().maxLevel
+        && grown.statistics().levelParents[0]==1;
+    //room for maxDist, even just past a power of the base
+    CoverTree<CoverTreePoint> justOver(ldexp(1.0,20)*(1+1e-9));
+    good = good && justOver.statistics().maxLevel==21;
+    CoverTree<CoverTreePoint> batch(points), batchPadded(1e30, points);
+    good = good && holdsExactly(batch, points)
+        && batch.statistics().maxLevel==batchPadded.statistics().maxLevel
+        && batch.statistics().levelParents[0]==1;
+    //and the lowest level is the lowest holding a node, when every point
+    //is far above level 0
+    vector<CoverTreePoint> coarse;
+    for(int i=0;i<500;i++) {
+        vector<double> c;
+        c.push_back(100.0*(rand()%100));
+        c.push_back(100.0*(rand()%100));
+        coarse.push_back(CoverTreePoint(c,'a'));
+    }
+    CoverTree<CoverTreePoint>::Statistics s = CoverTree<CoverTreePoint>(coarse).statistics();
+    good = good && s.minLevel > 0 && s.levelNodes.back() > 0;
+    //taking out the root and the farthest points lowers it again
+    int before = grown.statistics().maxLevel;
+    vector<CoverTreePoint> kept(points.begin()+1, points.end()-10);
+    grown.remove(points[0]);
+    for(unsigned int i=points.size()-10;i<points.size();i++) grown.remove(points[i]);
+    good = good && holdsExactly(grown, kept)
+        && grown.statistics().maxLevel < before
+        && grown.statistics().levelParents[0]==1;
+    padded.removeBatch(vector<CoverTreePoint>(points.end()-10, points.end()));
+    padded.remove(points[0]);
+    good = good && holdsExactly(padded, kept)
+        && padded.statistics().maxLevel==grown.statistics().maxLevel;
+    if(good) cout << "Root level test: \t\t\tPassed\n";
+    else cout << "Root level test: \t\t\tFailed\n";
 }
 
 void bigTest(unsigned int numNodes, unsigned int numDimensions){
@@ -157,6 +1016,21 @@ int main()
     srand(1);
 
     testTree();
+    testBatch();
+    testBoundedDistance();
+    testDistanceKernels();
+    testConcurrent();
+    testBase();
+    testSerialize();
+    testMapped();
+    testLoader();
+    testStatistics();
+    testOperationStats();
+    testApproximate();
+    testRemoveBatch();
+    testRootLevel();
+    testReleased();
+    testTaskPool();
     bigTest(3000,50);
     return 0;
 }